@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "bench_util.h"
+
+uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int connect_to(const char* host, int port)
+{
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo* addresses;
+    if (getaddrinfo(host, service, &hints, &addresses) != 0)
+        return -1;
+
+    int fd = socket(addresses->ai_family, addresses->ai_socktype, addresses->ai_protocol);
+    if (fd >= 0 && connect(fd, addresses->ai_addr, addresses->ai_addrlen) != 0) {
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(addresses);
+    if (fd < 0)
+        return -1;
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    return fd;
+}
+
+bool send_all(int fd, const void* buf, size_t len)
+{
+    const uint8_t* next = (const uint8_t*)buf;
+    while (len > 0) {
+        ssize_t sent = send(fd, next, len, MSG_NOSIGNAL);
+        if (sent <= 0)
+            return false;
+        next += sent;
+        len -= sent;
+    }
+    return true;
+}
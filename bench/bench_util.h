@@ -0,0 +1,14 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Helpers shared by the benchmarks.
+
+// Nanoseconds on the monotonic clock.
+uint64_t now_ns();
+
+// A TCP connection with Nagle turned off, or -1 if it could not be made.
+int connect_to(const char* host, int port);
+
+// Returns false if the connection failed before all of buf was sent.
+bool send_all(int fd, const void* buf, size_t len);
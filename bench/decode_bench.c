@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "arena.h"
+#include "serialization.h"
+#include "uptime_report_msg.pb-c.h"
+
+// Decodes the same set of realistic reports over and over with each
+// decoder and prints the mean cost per report.
+
+static const int sample_count = 1024;
+static const int iterations = 4 * 1000 * 1000;
+
+typedef struct sample_t {
+    uint8_t buf[256];
+    size_t len;
+} sample_t;
+
+static sample_t samples[1024];
+static volatile uint64_t sink;     // Keeps the decode loops from being optimized away
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void build_samples()
+{
+    srand(1);
+    for (int i = 0; i < sample_count; i++) {
+        char mac_address[18];
+        char description[64];
+        snprintf(mac_address, sizeof(mac_address), "%02x:%02x:%02x:%02x:%02x:%02x",
+            rand() & 0xff, rand() & 0xff, rand() & 0xff, rand() & 0xff, rand() & 0xff, rand() & 0xff);
+        snprintf(description, sizeof(description), "Sensor %d, building %d", rand() % 1000, rand() % 50);
+
+        uptime_report_view_t view = {
+            { mac_address, strlen(mac_address) },
+            { description, strlen(description) },
+            (uint32_t)rand()
+        };
+        samples[i].len = encode_report_view(&view, samples[i].buf);
+    }
+}
+
+static void print_result(const char* name, double elapsed_ns)
+{
+    printf("%-32s %8.1f ns/report\n", name, elapsed_ns / iterations);
+}
+
+static void bench_protobuf_c()
+{
+    double start = now_ns();
+    for (int i = 0; i < iterations; i++) {
+        sample_t* sample = &samples[i & (sample_count - 1)];
+        UptimeReportMsg* msg = uptime_report_msg__unpack(NULL, sample->len, sample->buf);
+        sink += msg->uptime;
+        uptime_report_msg__free_unpacked(msg, NULL);
+    }
+    print_result("uptime_report_msg__unpack", now_ns() - start);
+}
+
+static void bench_deserialize_report()
+{
+    struct arena* arena = arena_init(8192);
+
+    double start = now_ns();
+    for (int i = 0; i < iterations; i++) {
+        sample_t* sample = &samples[i & (sample_count - 1)];
+        uptime_report_t* report = deserialize_report((const char*)sample->buf, sample->len, arena);
+        sink += report->uptime;
+        arena_reset(arena);
+    }
+    print_result("deserialize_report (arena)", now_ns() - start);
+
+    arena_free(arena);
+}
+
+static void bench_decode_report_view()
+{
+    double start = now_ns();
+    for (int i = 0; i < iterations; i++) {
+        sample_t* sample = &samples[i & (sample_count - 1)];
+        uptime_report_view_t view;
+        decode_report_view(sample->buf, sample->len, &view);
+        sink += view.uptime;
+    }
+    print_result("decode_report_view", now_ns() - start);
+}
+
+int main(int argc, char** argv)
+{
+    build_samples();
+
+    bench_protobuf_c();
+    bench_deserialize_report();
+    bench_decode_report_view();
+
+    return 0;
+}
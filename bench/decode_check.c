@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "serialization.h"
+#include "uptime_report_msg.pb-c.h"
+
+// Differential check of decode_report_view against protobuf-c.  Generates
+// reports, mangles them in the ways a network peer might, and decodes each
+// with both.  Wherever decode_report_view settles a report itself it must
+// agree with protobuf-c:
+//  - REPORT_DECODE_OK: protobuf-c decodes the same fields, and the report
+//    re-encodes byte for byte the same as protobuf-c packs it
+//  - REPORT_DECODE_MALFORMED: protobuf-c rejects it too
+// REPORT_DECODE_UNRECOGNIZED is handed to protobuf-c by deserialize_report,
+// so it only needs counting.  Exits non-zero on any disagreement.
+
+static const int reports_per_mutation = 200000;
+static const int max_mismatches_shown = 8;
+
+typedef enum {
+    MUTATION_NONE,
+    MUTATION_TRUNCATE,
+    MUTATION_FLIP_BITS,
+    MUTATION_DROP_FIELD,
+    MUTATION_DUPLICATE_FIELD,
+    MUTATION_EXTRA_FIELD,
+    MUTATION_WIDE_UPTIME,
+    MUTATION_COUNT
+} mutation;
+
+static const char* mutation_names[MUTATION_COUNT] = {
+    "valid", "truncated", "bit-flipped", "missing field", "repeated field", "extra field", "64-bit uptime"
+};
+
+typedef struct check_counts_t {
+    int ok;
+    int malformed;
+    int unrecognized;
+    int mismatches;
+} check_counts_t;
+
+#define max_sample_len 1024
+
+typedef struct sample_t {
+    uint8_t buf[max_sample_len];
+    size_t len;
+} sample_t;
+
+static int mismatches_shown = 0;
+
+static uint32_t random_u32()
+{
+    return ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+}
+
+// String lengths straddle the one and two byte length prefixes.
+static size_t random_string(char* out, size_t max_len)
+{
+    static const size_t lengths[] = { 0, 1, 17, 127, 128, 300 };
+    size_t len = lengths[rand() % (sizeof(lengths) / sizeof(lengths[0]))];
+    if (len > max_len)
+        len = max_len;
+
+    for (size_t i = 0; i < len; i++)
+        out[i] = (char)(0x20 + rand() % 0x5f);
+    return len;
+}
+
+static uint32_t random_uptime()
+{
+    switch (rand() % 4) {
+        case 0: return 0;
+        case 1: return 0xffffffffu;
+        case 2: return rand() % 5000;
+        default: return random_u32();
+    }
+}
+
+static size_t append_string_field(uint8_t* out, uint8_t tag, const char* data, size_t len)
+{
+    size_t written = 0;
+    out[written++] = tag;
+    written += encode_varint(len, out + written);
+    memcpy(out + written, data, len);
+    return written + len;
+}
+
+static size_t append_varint_field(uint8_t* out, uint8_t tag, uint64_t value)
+{
+    out[0] = tag;
+    return 1 + encode_varint(value, out + 1);
+}
+
+// Fields of uptime_report_msg, in schema order.
+static size_t append_field(uint8_t* out, int field, const char* mac_address, size_t mac_len,
+    const char* description, size_t description_len, uint64_t uptime)
+{
+    switch (field) {
+        case 0: return append_string_field(out, 0x0a, mac_address, mac_len);
+        case 1: return append_string_field(out, 0x12, description, description_len);
+        default: return append_varint_field(out, 0x18, uptime);
+    }
+}
+
+// A field number the schema doesn't have, with each wire type protobuf-c
+// knows how to skip.
+static size_t append_unknown_field(uint8_t* out)
+{
+    static const int wire_types[] = { 0, 1, 2, 5 };     // Varint, 64-bit, length-delimited, 32-bit
+    static const uint8_t payload[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+
+    uint64_t field = 4 + rand() % 100;
+    int wire_type = wire_types[rand() % 4];
+
+    size_t len = encode_varint(field << 3 | wire_type, out);
+    switch (wire_type) {
+        case 0: return len + encode_varint(random_u32(), out + len);
+        case 1: memcpy(out + len, payload, 8); return len + 8;
+        case 2: out[len] = 3; memcpy(out + len + 1, payload, 3); return len + 4;
+        default: memcpy(out + len, payload, 4); return len + 4;
+    }
+}
+
+static void build_sample(mutation kind, sample_t* sample)
+{
+    char mac_address[300];
+    char description[300];
+    size_t mac_len = random_string(mac_address, sizeof(mac_address));
+    size_t description_len = random_string(description, sizeof(description));
+    uint64_t uptime = random_uptime();
+
+    if (kind == MUTATION_WIDE_UPTIME)
+        uptime = ((uint64_t)random_u32() << 32) | random_u32();
+
+    int dropped = (kind == MUTATION_DROP_FIELD) ? rand() % 3 : -1;
+    int repeated = (kind == MUTATION_DUPLICATE_FIELD) ? rand() % 3 : -1;
+
+    // Fields are usually in schema order, but protobuf allows any order.
+    int order[3] = { 0, 1, 2 };
+    if (rand() % 4 == 0) {
+        int i = rand() % 3, j = rand() % 3;
+        int swapped = order[i];
+        order[i] = order[j];
+        order[j] = swapped;
+    }
+
+    size_t len = 0;
+    for (int i = 0; i < 3; i++) {
+        int field = order[i];
+        if (field == dropped)
+            continue;
+
+        if (field == repeated) {
+            // The first copy carries different values; the last one wins.
+            char other[300];
+            size_t other_len = random_string(other, sizeof(other));
+            len += append_field(sample->buf + len, field, other, other_len, other, other_len, random_uptime());
+        }
+        len += append_field(sample->buf + len, field, mac_address, mac_len, description, description_len, uptime);
+    }
+
+    if (kind == MUTATION_EXTRA_FIELD) {
+        // Anywhere in the message, not only at the end.
+        uint8_t unknown[32];
+        size_t unknown_len = append_unknown_field(unknown);
+        size_t at = (rand() % 2) ? len : 0;
+        memmove(sample->buf + at + unknown_len, sample->buf + at, len - at);
+        memcpy(sample->buf + at, unknown, unknown_len);
+        len += unknown_len;
+    }
+
+    if (kind == MUTATION_TRUNCATE && len > 0)
+        len = rand() % len;
+
+    if (kind == MUTATION_FLIP_BITS && len > 0) {
+        int flips = 1 + rand() % 3;
+        for (int i = 0; i < flips; i++)
+            sample->buf[rand() % len] ^= (uint8_t)(1 << (rand() % 8));
+    }
+
+    sample->len = len;
+}
+
+static void show_mismatch(mutation kind, const sample_t* sample, const char* problem)
+{
+    if (mismatches_shown++ >= max_mismatches_shown)
+        return;
+
+    printf("  %s report, %s:", mutation_names[kind], problem);
+    for (size_t i = 0; i < sample->len; i++)
+        printf(" %02x", sample->buf[i]);
+    printf("\n");
+}
+
+static bool same_string(string_view_t view, const char* str)
+{
+    return str != NULL && memcmp(view.data, str, view.len) == 0 && str[view.len] == '\0';
+}
+
+static char* copy_string(string_view_t view)
+{
+    char* str = (char*)malloc(view.len + 1);
+    memcpy(str, view.data, view.len);
+    str[view.len] = '\0';
+    return str;
+}
+
+// The report as the service holds it, NUL-terminated strings and all,
+// against what protobuf-c would pack for the message it decoded.
+static bool reencodes_identically(const uptime_report_view_t* view, const UptimeReportMsg* msg)
+{
+    uptime_report_t report = { copy_string(view->mac_address), copy_string(view->description), view->uptime };
+    size_t len;
+    uint8_t* encoded = serialize_report(&report, &len);
+
+    uint8_t* packed = (uint8_t*)malloc(uptime_report_msg__get_packed_size(msg));
+    size_t packed_len = uptime_report_msg__pack(msg, packed);
+
+    bool same = len == packed_len && memcmp(encoded, packed, len) == 0;
+
+    free(packed);
+    free(encoded);
+    free(report.mac_address);
+    free(report.description);
+    return same;
+}
+
+static void check_sample(mutation kind, const sample_t* sample, check_counts_t* counts)
+{
+    uptime_report_view_t view;
+    report_decode_result result = decode_report_view(sample->buf, sample->len, &view);
+    UptimeReportMsg* msg = uptime_report_msg__unpack(NULL, sample->len, sample->buf);
+
+    switch (result) {
+        case REPORT_DECODE_OK:
+            counts->ok++;
+            if (NULL == msg) {
+                counts->mismatches++;
+                show_mismatch(kind, sample, "decoded but protobuf-c rejects it");
+            } else if (!same_string(view.mac_address, msg->mac_address) ||
+                !same_string(view.description, msg->description) || view.uptime != msg->uptime) {
+                counts->mismatches++;
+                show_mismatch(kind, sample, "fields differ from protobuf-c");
+            } else if (!reencodes_identically(&view, msg)) {
+                counts->mismatches++;
+                show_mismatch(kind, sample, "re-encoding differs from protobuf-c");
+            }
+            break;
+        case REPORT_DECODE_MALFORMED:
+            counts->malformed++;
+            if (msg != NULL) {
+                counts->mismatches++;
+                show_mismatch(kind, sample, "rejected but protobuf-c decodes it");
+            }
+            break;
+        case REPORT_DECODE_UNRECOGNIZED:
+            counts->unrecognized++;
+            break;
+    }
+
+    if (msg != NULL)
+        uptime_report_msg__free_unpacked(msg, NULL);
+}
+
+int main(int argc, char** argv)
+{
+    srand((argc > 1) ? (unsigned)atoi(argv[1]) : 1);
+
+    int total_mismatches = 0;
+    printf("%-16s %10s %10s %10s %12s %10s\n", "", "reports", "decoded", "malformed", "unrecognized", "mismatches");
+
+    for (int kind = 0; kind < MUTATION_COUNT; kind++) {
+        check_counts_t counts = { 0, 0, 0, 0 };
+
+        for (int i = 0; i < reports_per_mutation; i++) {
+            sample_t sample;
+            build_sample((mutation)kind, &sample);
+            check_sample((mutation)kind, &sample, &counts);
+        }
+
+        printf("%-16s %10d %10d %10d %12d %10d\n", mutation_names[kind], reports_per_mutation,
+            counts.ok, counts.malformed, counts.unrecognized, counts.mismatches);
+        total_mismatches += counts.mismatches;
+    }
+
+    if (total_mismatches > 0) {
+        printf("decode_report_view disagreed with protobuf-c on %d reports.\n", total_mismatches);
+        return 1;
+    }
+    return 0;
+}
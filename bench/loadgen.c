@@ -0,0 +1,293 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include "serialization.h"
+#include "scrape.h"
+#include "bench_util.h"
+
+// Drives a running upkeep instance with uptime reports over the ingest
+// port at a fixed rate, then reads back from its /metrics and /proc how
+// many it decoded and committed, how long entries waited to be committed
+// and how much CPU it took.  Devices and reboots are drawn from fixed
+// seeds, so runs with the same options send the same reports.
+
+typedef struct loadgen_options_t {
+    const char* host;
+    int port;
+    int metrics_port;
+    int devices;
+    int rate;                       // Reports per second, over all connections
+    int duration_sec;
+    int connections;
+    int reports_per_connection;     // Reconnect after this many; 0 keeps one connection
+    double reboot_fraction;         // Share of reports that look like a reboot
+    pid_t pid;
+} loadgen_options_t;
+
+typedef struct sender_t {
+    int index;
+    pthread_t thread;
+    unsigned int seed;
+    uint64_t sent;
+    uint64_t connects;
+    uint64_t failures;
+} sender_t;
+
+static loadgen_options_t options = {
+    "127.0.0.1", 12001, 15001,
+    1000, 10000, 10, 8, 0, 0.01, 0
+};
+
+static const int tick_ns = 1000 * 1000;        // Reports due are sent once a millisecond
+static const size_t send_buffer_size = 64 * 1024;
+static const size_t max_encoded_report_len = 128;   // Varint prefix included
+static const uint32_t base_uptime_ms = 10 * 1000 * 1000;
+static const int drain_timeout_sec = 10;
+
+static uint64_t started_at_ns;
+
+static void sleep_until(uint64_t deadline_ns)
+{
+    struct timespec ts = { deadline_ns / 1000000000ull, deadline_ns % 1000000000ull };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+// Devices are split between connections, each always reporting on the
+// same one.  Uptimes grow with the run unless the report is a reboot,
+// which upkeep recognizes by an uptime under five seconds.
+static size_t append_report(sender_t* sender, uint64_t report, uint8_t* out)
+{
+    int devices_per_sender = (options.devices + options.connections - 1) / options.connections;
+    int device = sender->index + (int)(report % devices_per_sender) * options.connections;
+    if (device >= options.devices)
+        device = sender->index;
+
+    char mac_address[18];
+    char description[64];
+    snprintf(mac_address, sizeof(mac_address), "02:00:%02x:%02x:%02x:%02x",
+        (device >> 24) & 0xff, (device >> 16) & 0xff, (device >> 8) & 0xff, device & 0xff);
+    snprintf(description, sizeof(description), "loadgen device %d", device);
+
+    bool reboot = rand_r(&sender->seed) < options.reboot_fraction * RAND_MAX;
+    uint32_t uptime = reboot ? (uint32_t)(rand_r(&sender->seed) % 1000)
+        : base_uptime_ms + (uint32_t)((now_ns() - started_at_ns) / 1000000);
+
+    uptime_report_view_t view = {
+        { mac_address, strlen(mac_address) },
+        { description, strlen(description) },
+        uptime
+    };
+
+    size_t len = get_report_view_size(&view);
+    size_t prefix_len = encode_varint(len, out);
+    return prefix_len + encode_report_view(&view, out + prefix_len);
+}
+
+static void* run_sender(void* arg)
+{
+    sender_t* sender = (sender_t*)arg;
+    uint8_t* buffer = (uint8_t*)malloc(send_buffer_size);
+    uint64_t deadline_ns = started_at_ns + (uint64_t)options.duration_sec * 1000000000ull;
+    double rate = (double)options.rate / options.connections;
+    uint64_t on_connection = 0;
+    int fd = -1;
+
+    for (uint64_t tick = started_at_ns; tick < deadline_ns; tick += tick_ns) {
+        sleep_until(tick);
+
+        // Anything that fell behind goes out in this tick's write.
+        uint64_t due = (uint64_t)(rate * (tick - started_at_ns) / 1e9);
+        while (sender->sent < due) {
+            if (fd < 0) {
+                fd = connect_to(options.host, options.port);
+                if (fd < 0) {
+                    sender->failures++;
+                    break;
+                }
+                sender->connects++;
+                on_connection = 0;
+            }
+
+            size_t len = 0;
+            uint64_t batch = 0;
+            while (sender->sent + batch < due && len + max_encoded_report_len <= send_buffer_size) {
+                if (options.reports_per_connection > 0 && on_connection + batch >= options.reports_per_connection)
+                    break;
+                len += append_report(sender, sender->sent + batch, buffer + len);
+                batch++;
+            }
+
+            if (!send_all(fd, buffer, len)) {
+                sender->failures++;
+                close(fd);
+                fd = -1;
+                break;
+            }
+
+            sender->sent += batch;
+            on_connection += batch;
+
+            if (options.reports_per_connection > 0 && on_connection >= options.reports_per_connection) {
+                close(fd);
+                fd = -1;
+            }
+        }
+    }
+
+    if (fd >= 0)
+        close(fd);
+    free(buffer);
+    return NULL;
+}
+
+static void print_usage(const char* name)
+{
+    printf("Usage: %s [options]\n"
+        "  -h host         upkeep host (%s)\n"
+        "  -p port         ingest port (%d)\n"
+        "  -m port         web interface port, for /metrics (%d)\n"
+        "  -d devices      simulated devices (%d)\n"
+        "  -r rate         reports per second (%d)\n"
+        "  -t seconds      how long to send for (%d)\n"
+        "  -c connections  concurrent connections, one thread each (%d)\n"
+        "  -n reports      reconnect after this many reports; 0 keeps one connection (%d)\n"
+        "  -b fraction     share of reports that are reboots (%g)\n"
+        "  -P pid          upkeep process, for CPU time; found by name if omitted\n",
+        name, options.host, options.port, options.metrics_port, options.devices, options.rate,
+        options.duration_sec, options.connections, options.reports_per_connection, options.reboot_fraction);
+}
+
+static bool parse_options(int argc, char** argv)
+{
+    int option;
+    while ((option = getopt(argc, argv, "h:p:m:d:r:t:c:n:b:P:")) != -1) {
+        switch (option) {
+            case 'h': options.host = optarg; break;
+            case 'p': options.port = atoi(optarg); break;
+            case 'm': options.metrics_port = atoi(optarg); break;
+            case 'd': options.devices = atoi(optarg); break;
+            case 'r': options.rate = atoi(optarg); break;
+            case 't': options.duration_sec = atoi(optarg); break;
+            case 'c': options.connections = atoi(optarg); break;
+            case 'n': options.reports_per_connection = atoi(optarg); break;
+            case 'b': options.reboot_fraction = atof(optarg); break;
+            case 'P': options.pid = (pid_t)atoi(optarg); break;
+            default: return false;
+        }
+    }
+
+    return options.devices > 0 && options.rate > 0 && options.duration_sec > 0 && options.connections > 0;
+}
+
+// Waits for every report sent to be committed, or for the commit count to
+// stop moving.
+static void wait_for_commits(double committed_before, uint64_t sent, metrics_scrape_t* after)
+{
+    double last_committed = -1;
+
+    for (int waited = 0; waited < drain_timeout_sec; waited++) {
+        sleep(1);
+        free_scrape(after);
+        if (!scrape_metrics(options.host, options.metrics_port, after))
+            return;
+
+        double committed = get_scraped_value(after, "upkeep_entries_committed_total") - committed_before;
+        if (committed >= sent || committed == last_committed)
+            return;
+        last_committed = committed;
+    }
+}
+
+static void print_latency(const char* stage, const metrics_scrape_t* before, const metrics_scrape_t* after)
+{
+    scraped_histogram_t before_histogram, after_histogram;
+    get_scraped_latencies(before, stage, &before_histogram);
+    if (!get_scraped_latencies(after, stage, &after_histogram)) {
+        printf("%-24s no samples\n", stage);
+        return;
+    }
+
+    printf("%-24s p50 %9.1f us   p99 %9.1f us   p99.9 %9.1f us\n", stage,
+        get_quantile_between(&before_histogram, &after_histogram, 0.5) * 1e6,
+        get_quantile_between(&before_histogram, &after_histogram, 0.99) * 1e6,
+        get_quantile_between(&before_histogram, &after_histogram, 0.999) * 1e6);
+}
+
+int main(int argc, char** argv)
+{
+    if (!parse_options(argc, argv)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (0 == options.pid)
+        options.pid = find_process("upkeep");
+
+    metrics_scrape_t before, after = { NULL, 0 };
+    if (!scrape_metrics(options.host, options.metrics_port, &before)) {
+        printf("Could not read /metrics from %s:%d. Is upkeep running?\n", options.host, options.metrics_port);
+        return 1;
+    }
+    double cpu_before = (options.pid > 0) ? get_process_cpu_seconds(options.pid) : 0;
+
+    printf("Sending %d reports/s from %d devices over %d connections for %d s (%d reports per connection, %.1f%% reboots).\n",
+        options.rate, options.devices, options.connections, options.duration_sec,
+        options.reports_per_connection, options.reboot_fraction * 100);
+
+    sender_t* senders = (sender_t*)calloc(options.connections, sizeof(sender_t));
+    started_at_ns = now_ns();
+    for (int i = 0; i < options.connections; i++) {
+        senders[i].index = i;
+        senders[i].seed = i + 1;
+        pthread_create(&senders[i].thread, NULL, run_sender, &senders[i]);
+    }
+
+    uint64_t sent = 0, connects = 0, failures = 0;
+    for (int i = 0; i < options.connections; i++) {
+        pthread_join(senders[i].thread, NULL);
+        sent += senders[i].sent;
+        connects += senders[i].connects;
+        failures += senders[i].failures;
+    }
+    double elapsed_sec = (now_ns() - started_at_ns) / 1e9;
+
+    double committed_before = get_scraped_value(&before, "upkeep_entries_committed_total");
+    wait_for_commits(committed_before, sent, &after);
+    if (NULL == after.text) {
+        printf("Lost /metrics after the run.\n");
+        return 1;
+    }
+    double cpu_sec = (options.pid > 0) ? get_process_cpu_seconds(options.pid) - cpu_before : 0;
+
+    double decoded = get_scraped_value(&after, "upkeep_reports_decoded_total") - get_scraped_value(&before, "upkeep_reports_decoded_total");
+    double committed = get_scraped_value(&after, "upkeep_entries_committed_total") - committed_before;
+
+    printf("\nSent      %10llu reports in %.2f s, %.0f reports/s (%llu connects, %llu failures)\n",
+        (unsigned long long)sent, elapsed_sec, sent / elapsed_sec, (unsigned long long)connects, (unsigned long long)failures);
+    printf("Decoded   %10.0f reports, %.0f reports/s\n", decoded, decoded / elapsed_sec);
+    printf("Committed %10.0f entries\n", committed);
+
+    if (options.pid > 0 && decoded > 0)
+        printf("CPU       %10.2f s, %.2f us per report\n", cpu_sec, cpu_sec * 1e6 / decoded);
+    else
+        printf("CPU       unknown; upkeep's pid was not found\n");
+
+    printf("\nIngest to commit\n");
+    print_latency("commit_wait", &before, &after);
+    printf("\nPer stage\n");
+    print_latency("read", &before, &after);
+    print_latency("deserialize_report", &before, &after);
+    print_latency("register_uptime_report", &before, &after);
+    print_latency("insert_uptime_entry", &before, &after);
+
+    free_scrape(&before);
+    free_scrape(&after);
+    free(senders);
+    return 0;
+}
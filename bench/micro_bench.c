@@ -0,0 +1,370 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "arena.h"
+#include "logger.h"
+#include "database.h"
+#include "serialization.h"
+#include "bench_util.h"
+
+// Times the hot functions of serialization, the database, the list and
+// the logger in isolation, each at a few sizes, and prints the mean cost
+// and number of allocations per call.  Each benchmark runs until it has
+// taken at least min_bench_ns, so cheap and expensive calls are both
+// timed over enough iterations to be stable.
+//
+// The database and log files go under bench_directory, never the
+// service's own.
+
+static const char* bench_directory = "/tmp/upkeep_bench/";
+static const char* bench_db_filepath = "/tmp/upkeep_bench/bench.sqlite";
+static const char* bench_zlog_config = "[formats]\nsimple = \"%m\"\n[rules]\nupkeep_log.DEBUG \"/tmp/upkeep_bench/bench.log\"; simple\n";
+
+static const uint64_t min_bench_ns = 200 * 1000 * 1000;
+static const int description_lengths[] = { 16, 64, 256 };
+static const int list_lengths[] = { 16, 1024, 65536 };
+static const int device_counts[] = { 1000, 100000 };
+static const int log_site_count = 512;     // Well within the logger's table of call sites
+static const int log_round_size = 2048;    // Half the logger's ring, so nothing is dropped
+
+static FILE* results;
+static volatile uint64_t sink;      // Keeps results from being optimized away
+
+// Every allocation made on the benchmarking thread is counted, so those
+// made deep inside SQLite or libc show up too.  Frees are not counted.
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+static __thread uint64_t allocations = 0;
+
+void* malloc(size_t size)
+{
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size)
+{
+    allocations++;
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+    allocations++;
+    return __libc_realloc(ptr, size);
+}
+
+typedef void (*bench_op)(void* state, uint64_t i);
+
+static void print_result(const char* name, uint64_t iterations, uint64_t elapsed_ns, uint64_t allocated)
+{
+    fprintf(results, "%-48s %12.1f ns/op %8.2f allocs/op %10llu ops\n", name,
+        (double)elapsed_ns / iterations, (double)allocated / iterations, (unsigned long long)iterations);
+    fflush(results);
+}
+
+static uint64_t time_iterations(bench_op op, void* state, uint64_t iterations, uint64_t* allocated)
+{
+    uint64_t allocations_before = allocations;
+    uint64_t start = now_ns();
+
+    for (uint64_t i = 0; i < iterations; i++)
+        op(state, i);
+
+    uint64_t elapsed = now_ns() - start;
+    *allocated = allocations - allocations_before;
+    return elapsed;
+}
+
+// Grows the iteration count until a run takes at least min_bench_ns.
+static void run_bench(const char* name, bench_op op, void* state)
+{
+    uint64_t iterations = 1;
+
+    for (;;) {
+        uint64_t allocated;
+        uint64_t elapsed = time_iterations(op, state, iterations, &allocated);
+
+        if (elapsed >= min_bench_ns) {
+            print_result(name, iterations, elapsed, allocated);
+            return;
+        }
+
+        uint64_t scale = (elapsed > 0) ? (min_bench_ns * 6 / 5) / elapsed + 1 : 100;
+        iterations *= (scale < 2) ? 2 : (scale > 100) ? 100 : scale;
+    }
+}
+
+// For functions whose cost changes once they have run too often, like the
+// logger's rate limit.  settle runs untimed between rounds.
+static void run_bench_rounds(const char* name, bench_op op, void* state, int rounds, uint64_t round_size, void (*settle)())
+{
+    uint64_t elapsed = 0;
+    uint64_t allocated = 0;
+
+    for (int round = 0; round < rounds; round++) {
+        uint64_t round_allocated;
+        elapsed += time_iterations(op, state, round_size, &round_allocated);
+        allocated += round_allocated;
+        settle();
+    }
+
+    print_result(name, rounds * round_size, elapsed, allocated);
+}
+
+static char* make_string(const char* prefix, int len)
+{
+    char* str = (char*)malloc(len + 1);
+    int prefix_len = snprintf(str, len + 1, "%s", prefix);
+    for (int i = prefix_len; i < len; i++)
+        str[i] = 'a' + (i % 26);
+    str[len] = '\0';
+    return str;
+}
+
+static char* make_mac_address(int device)
+{
+    char* mac_address = (char*)malloc(18);
+    snprintf(mac_address, 18, "02:00:%02x:%02x:%02x:%02x",
+        (device >> 24) & 0xff, (device >> 16) & 0xff, (device >> 8) & 0xff, device & 0xff);
+    return mac_address;
+}
+
+// serialize_report and deserialize_report
+
+typedef struct serialization_state_t {
+    uptime_report_t report;
+    uint8_t* encoded;
+    size_t encoded_len;
+    struct arena* arena;
+} serialization_state_t;
+
+static void serialize_op(void* state, uint64_t i)
+{
+    serialization_state_t* s = (serialization_state_t*)state;
+    size_t len;
+    uint8_t* buf = serialize_report(&s->report, &len);
+    sink += len;
+    free(buf);
+}
+
+static void deserialize_op(void* state, uint64_t i)
+{
+    serialization_state_t* s = (serialization_state_t*)state;
+    uptime_report_t* report = deserialize_report((const char*)s->encoded, s->encoded_len, s->arena);
+    sink += report->uptime;
+    arena_reset(s->arena);
+}
+
+static void bench_serialization()
+{
+    for (int i = 0; i < sizeof(description_lengths) / sizeof(description_lengths[0]); i++) {
+        serialization_state_t state;
+        state.report.mac_address = make_mac_address(i);
+        state.report.description = make_string("Sensor ", description_lengths[i]);
+        state.report.uptime = 123456789;
+        state.encoded = serialize_report(&state.report, &state.encoded_len);
+        state.arena = arena_init(8192);
+
+        char name[64];
+        snprintf(name, sizeof(name), "serialize_report (description %d)", description_lengths[i]);
+        run_bench(name, serialize_op, &state);
+        snprintf(name, sizeof(name), "deserialize_report (description %d)", description_lengths[i]);
+        run_bench(name, deserialize_op, &state);
+
+        arena_free(state.arena);
+        free(state.encoded);
+        free(state.report.mac_address);
+        free(state.report.description);
+    }
+}
+
+// list_append, starting a new list whenever one reaches its length
+
+typedef struct list_state_t {
+    list* collection;
+    uint64_t length;
+} list_state_t;
+
+static void list_append_op(void* state, uint64_t i)
+{
+    list_state_t* s = (list_state_t*)state;
+    if (i % s->length == 0) {
+        list_free(s->collection);
+        s->collection = list_init();
+    }
+    list_append(s->collection, s);
+}
+
+static void bench_list()
+{
+    for (int i = 0; i < sizeof(list_lengths) / sizeof(list_lengths[0]); i++) {
+        list_state_t state = { list_init(), list_lengths[i] };
+
+        char name[64];
+        snprintf(name, sizeof(name), "list_append (lists of %d)", list_lengths[i]);
+        run_bench(name, list_append_op, &state);
+
+        list_free(state.collection);
+    }
+}
+
+// get_last_known_uptime and insert_uptime_entry, against a database
+// already holding a number of devices
+
+typedef struct database_state_t {
+    char** mac_addresses;
+    char** descriptions;
+    int device_count;
+} database_state_t;
+
+// Visits devices in a scattered but repeatable order.
+static int pick_device(database_state_t* s, uint64_t i)
+{
+    return (int)((i * 2654435761u) % s->device_count);
+}
+
+static void get_last_known_uptime_op(void* state, uint64_t i)
+{
+    database_state_t* s = (database_state_t*)state;
+    sink += get_last_known_uptime(s->mac_addresses[pick_device(s, i)]);
+}
+
+static void insert_uptime_entry_op(void* state, uint64_t i)
+{
+    database_state_t* s = (database_state_t*)state;
+    int device = pick_device(s, i);
+    uptime_entry_t entry = { s->mac_addresses[device], s->descriptions[device], (uint32_t)i, time(NULL) };
+    insert_uptime_entry(&entry);
+}
+
+static void add_devices(database_state_t* s, int device_count)
+{
+    s->mac_addresses = (char**)realloc(s->mac_addresses, device_count * sizeof(char*));
+    s->descriptions = (char**)realloc(s->descriptions, device_count * sizeof(char*));
+
+    for (int device = s->device_count; device < device_count; device++) {
+        s->mac_addresses[device] = make_mac_address(device);
+        s->descriptions[device] = make_string("Device ", 32);
+
+        uptime_entry_t entry = { s->mac_addresses[device], s->descriptions[device], 1000000, time(NULL) };
+        queue_uptime_entry(&entry);
+    }
+
+    flush_uptime_entries();
+    s->device_count = device_count;
+}
+
+static void bench_database()
+{
+    unlink(bench_db_filepath);
+    init_database_at(bench_directory, bench_db_filepath);
+
+    database_state_t state = { NULL, NULL, 0 };
+
+    for (int i = 0; i < sizeof(device_counts) / sizeof(device_counts[0]); i++) {
+        add_devices(&state, device_counts[i]);
+
+        char name[64];
+        snprintf(name, sizeof(name), "get_last_known_uptime (%d devices)", device_counts[i]);
+        run_bench(name, get_last_known_uptime_op, &state);
+        snprintf(name, sizeof(name), "insert_uptime_entry (%d devices)", device_counts[i]);
+        run_bench(name, insert_uptime_entry_op, &state);
+    }
+
+    shutdown_database();
+
+    for (int device = 0; device < state.device_count; device++) {
+        free(state.mac_addresses[device]);
+        free(state.descriptions[device]);
+    }
+    free(state.mac_addresses);
+    free(state.descriptions);
+}
+
+// queue_log, through log_info.  One call site is rate limited almost at
+// once, so the queueing path is timed over many sites, each staying within
+// its burst; a single site times the cost of being rate limited.
+
+static void log_sites_op(void* state, uint64_t i)
+{
+    char** formats = (char**)state;
+    log_info(formats[i % log_site_count], (unsigned long long)i);
+}
+
+static void log_one_site_op(void* state, uint64_t i)
+{
+    log_info("Benchmark message %llu from a single call site.", (unsigned long long)i);
+}
+
+static void bench_logger()
+{
+    // Deferred formatting reads the format when the line is written, so
+    // these are never freed.
+    char** formats = (char**)malloc(log_site_count * sizeof(char*));
+    for (int i = 0; i < log_site_count; i++) {
+        formats[i] = (char*)malloc(64);
+        snprintf(formats[i], 64, "Benchmark message %%llu from call site %d.", i);
+    }
+
+    uint64_t dropped_before = get_dropped_log_count();
+
+    // The writer is left to catch up between rounds, which keeps every
+    // site within its burst and the ring from filling.
+    char name[64];
+    int rounds = log_site_count * log_rate_limit_burst / 2 / log_round_size;
+    snprintf(name, sizeof(name), "queue_log (%d call sites)", log_site_count);
+    run_bench_rounds(name, log_sites_op, formats, rounds, log_round_size, force_log_flush);
+
+    uint64_t dropped = get_dropped_log_count() - dropped_before;
+    if (dropped > 0)
+        fprintf(results, "%-48s %12llu dropped with the queue full\n", "", (unsigned long long)dropped);
+
+    run_bench("queue_log (1 call site, rate limited)", log_one_site_op, NULL);
+    force_log_flush();
+}
+
+// Runs from bench_directory so that init_logger picks up a zlog.conf that
+// logs there.  The logger also echoes every line to stdout, so results go
+// to a copy of the original stdout and stdout itself to a file.
+static bool enter_bench_directory()
+{
+    char cmd[128];
+    snprintf(cmd, sizeof(cmd), "mkdir -p %s", bench_directory);
+    if (system(cmd) != 0 || chdir(bench_directory) != 0)
+        return false;
+
+    FILE* config = fopen("zlog.conf", "w");
+    if (NULL == config)
+        return false;
+    fputs(bench_zlog_config, config);
+    fclose(config);
+
+    results = fdopen(dup(STDOUT_FILENO), "w");
+    return freopen("stdout.log", "w", stdout) != NULL;
+}
+
+int main(int argc, char** argv)
+{
+    if (!enter_bench_directory()) {
+        fprintf(stderr, "Could not set up %s.\n", bench_directory);
+        return 1;
+    }
+
+    if (!init_logger()) {
+        fprintf(results, "Could not start the logger.\n");
+        return 1;
+    }
+
+    bench_serialization();
+    bench_list();
+    bench_database();
+    bench_logger();
+
+    shutdown_logger();
+    return 0;
+}
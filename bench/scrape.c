@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include "scrape.h"
+#include "bench_util.h"
+
+bool scrape_metrics(const char* host, int port, metrics_scrape_t* scrape)
+{
+    static const char* request = "GET /metrics HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+
+    scrape->text = NULL;
+    scrape->len = 0;
+
+    int fd = connect_to(host, port);
+    if (fd < 0)
+        return false;
+
+    if (!send_all(fd, request, strlen(request))) {
+        close(fd);
+        return false;
+    }
+
+    // Read until the whole body has arrived.  lws may keep the connection
+    // open after the response, so the Content-Length decides.  The buffer
+    // can move as it grows, so the body is tracked by its offset.
+    size_t capacity = 64 * 1024;
+    size_t len = 0;
+    char* response = (char*)malloc(capacity + 1);
+    size_t body_offset = 0;         // 0 until the headers have all arrived
+    size_t content_length = 0;
+
+    for (;;) {
+        if (len == capacity) {
+            capacity *= 2;
+            response = (char*)realloc(response, capacity + 1);
+        }
+
+        ssize_t received = recv(fd, response + len, capacity - len, 0);
+        if (received <= 0)
+            break;
+        len += received;
+        response[len] = '\0';
+
+        if (0 == body_offset) {
+            char* headers_end = strstr(response, "\r\n\r\n");
+            if (NULL == headers_end)
+                continue;
+            body_offset = headers_end + 4 - response;
+
+            char* length_header = strcasestr(response, "Content-Length:");
+            if (length_header != NULL && (size_t)(length_header - response) < body_offset)
+                content_length = strtoull(length_header + strlen("Content-Length:"), NULL, 10);
+        }
+
+        if (content_length > 0 && len - body_offset >= content_length)
+            break;
+    }
+
+    close(fd);
+
+    if (0 == body_offset) {
+        free(response);
+        return false;
+    }
+
+    scrape->len = len - body_offset;
+    scrape->text = (char*)malloc(scrape->len + 1);
+    memcpy(scrape->text, response + body_offset, scrape->len);
+    scrape->text[scrape->len] = '\0';
+    free(response);
+    return true;
+}
+
+void free_scrape(metrics_scrape_t* scrape)
+{
+    free(scrape->text);
+    scrape->text = NULL;
+    scrape->len = 0;
+}
+
+// Finds the sample line that starts with prefix, skipping comments.
+static const char* find_line(const char* text, const char* prefix)
+{
+    size_t prefix_len = strlen(prefix);
+
+    for (const char* line = text; line != NULL && *line != '\0'; ) {
+        if (strncmp(line, prefix, prefix_len) == 0)
+            return line;
+        line = strchr(line, '\n');
+        if (line != NULL)
+            line++;
+    }
+    return NULL;
+}
+
+double get_scraped_value(const metrics_scrape_t* scrape, const char* name)
+{
+    char prefix[128];
+    snprintf(prefix, sizeof(prefix), "%s ", name);
+
+    const char* line = find_line(scrape->text, prefix);
+    return (line != NULL) ? strtod(line + strlen(prefix), NULL) : 0;
+}
+
+bool get_scraped_latencies(const metrics_scrape_t* scrape, const char* stage, scraped_histogram_t* histogram)
+{
+    char prefix[128];
+    snprintf(prefix, sizeof(prefix), "upkeep_stage_latency_seconds_bucket{stage=\"%s\",le=\"", stage);
+    size_t prefix_len = strlen(prefix);
+
+    histogram->bucket_count = 0;
+
+    const char* line = find_line(scrape->text, prefix);
+    while (line != NULL && strncmp(line, prefix, prefix_len) == 0 && histogram->bucket_count < scrape_max_buckets) {
+        const char* bound = line + prefix_len;
+        const char* value = strstr(bound, "} ");
+        if (NULL == value)
+            break;
+
+        int i = histogram->bucket_count++;
+        histogram->bounds[i] = (strncmp(bound, "+Inf", 4) == 0) ? -1 : strtod(bound, NULL);
+        histogram->cumulative[i] = strtoull(value + 2, NULL, 10);
+
+        line = strchr(line, '\n');
+        if (line != NULL)
+            line++;
+    }
+
+    return histogram->bucket_count > 0;
+}
+
+double get_quantile_between(const scraped_histogram_t* before, const scraped_histogram_t* after, double quantile)
+{
+    int count = after->bucket_count;
+    if (count == 0)
+        return -1;
+
+    uint64_t total = after->cumulative[count - 1] - ((before->bucket_count == count) ? before->cumulative[count - 1] : 0);
+    if (total == 0)
+        return -1;
+
+    double rank = quantile * total;
+    double lower_bound = 0;
+    uint64_t lower_count = 0;
+
+    for (int i = 0; i < count; i++) {
+        uint64_t cumulative = after->cumulative[i] - ((before->bucket_count == count) ? before->cumulative[i] : 0);
+
+        if (cumulative >= rank && cumulative > lower_count) {
+            // Nothing to interpolate towards past the last finite bound.
+            if (after->bounds[i] < 0)
+                return lower_bound;
+            return lower_bound + (after->bounds[i] - lower_bound) * (rank - lower_count) / (cumulative - lower_count);
+        }
+
+        lower_bound = after->bounds[i];
+        lower_count = cumulative;
+    }
+
+    return lower_bound;
+}
+
+pid_t find_process(const char* name)
+{
+    DIR* proc = opendir("/proc");
+    if (NULL == proc)
+        return 0;
+
+    pid_t found = 0;
+    struct dirent* dir;
+    while (found == 0 && (dir = readdir(proc)) != NULL) {
+        pid_t pid = (pid_t)atoi(dir->d_name);
+        if (pid <= 0 || pid == getpid())
+            continue;
+
+        char path[64];
+        char comm[64] = {0};
+        snprintf(path, sizeof(path), "/proc/%d/comm", (int)pid);
+
+        FILE* file = fopen(path, "r");
+        if (NULL == file)
+            continue;
+        if (fgets(comm, sizeof(comm), file) != NULL) {
+            comm[strcspn(comm, "\n")] = '\0';
+            if (strcmp(comm, name) == 0)
+                found = pid;
+        }
+        fclose(file);
+    }
+
+    closedir(proc);
+    return found;
+}
+
+double get_process_cpu_seconds(pid_t pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+
+    FILE* file = fopen(path, "r");
+    if (NULL == file)
+        return 0;
+
+    char stat[1024];
+    size_t len = fread(stat, 1, sizeof(stat) - 1, file);
+    fclose(file);
+    stat[len] = '\0';
+
+    // The command name may hold spaces, so count fields from its closing
+    // parenthesis.  utime and stime are the 14th and 15th fields.
+    char* fields = strrchr(stat, ')');
+    if (NULL == fields)
+        return 0;
+
+    unsigned long long utime = 0, stime = 0;
+    if (sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2)
+        return 0;
+
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
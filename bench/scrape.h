@@ -0,0 +1,42 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Helpers for benchmarks that drive a running upkeep instance and read
+// back what it did, from /metrics on the web interface and from /proc.
+
+// One scrape of /metrics.  Only the lines the benchmarks look at are kept.
+#define scrape_max_buckets 64
+
+typedef struct scraped_histogram_t {
+    int bucket_count;
+    double bounds[scrape_max_buckets];      // Seconds, the last being +Inf
+    uint64_t cumulative[scrape_max_buckets];
+} scraped_histogram_t;
+
+typedef struct metrics_scrape_t {
+    char* text;
+    size_t len;
+} metrics_scrape_t;
+
+// GETs /metrics from the web interface.  Returns false if it could not be
+// reached.
+bool scrape_metrics(const char* host, int port, metrics_scrape_t* scrape);
+void free_scrape(metrics_scrape_t* scrape);
+
+// The value of an unlabeled counter or gauge, or 0 if it is missing.
+double get_scraped_value(const metrics_scrape_t* scrape, const char* name);
+
+// The buckets of one stage of upkeep_stage_latency_seconds.
+bool get_scraped_latencies(const metrics_scrape_t* scrape, const char* stage, scraped_histogram_t* histogram);
+
+// The quantile of the samples recorded between two scrapes, interpolated
+// linearly within a bucket the way Prometheus' histogram_quantile does.
+// Returns -1 if there were no samples.
+double get_quantile_between(const scraped_histogram_t* before, const scraped_histogram_t* after, double quantile);
+
+// Finds a running process by name, or returns 0.
+pid_t find_process(const char* name);
+
+// User plus system CPU time the process has used, from /proc/<pid>/stat.
+double get_process_cpu_seconds(pid_t pid);
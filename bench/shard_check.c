@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "hash_table.h"
+#include "database.h"
+
+// Checks that devices spread evenly over the buckets of each device table
+// shard.  Shards and their hash tables both index by the same hash, so if
+// the two ever draw on the same bits, every device in a shard lands in a
+// fraction of its buckets and lookups degrade into long chain walks.
+//
+// Devices are put into one table per shard, the way the database does,
+// and each table must use at least min_bucket_use of the buckets it would
+// be expected to with a uniform hash and keep its chains short.  Exits
+// non-zero if any shard falls short.
+
+#define shard_count 16
+
+static const int device_counts[] = { 1000, 6141, 100000 };
+static const double min_bucket_use = 0.75;     // Sharing bits with the shard caps this at 1/16
+static const size_t max_chain_len = 12;
+
+// Random mac addresses, as well as ones counting up from a vendor prefix
+// the way a batch of devices from one manufacturer would.
+static void make_mac_address(char* out, int device, bool sequential)
+{
+    if (sequential) {
+        snprintf(out, 18, "02:00:00:%02x:%02x:%02x", (device >> 16) & 0xff, (device >> 8) & 0xff, device & 0xff);
+        return;
+    }
+    snprintf(out, 18, "%02x:%02x:%02x:%02x:%02x:%02x",
+        rand() & 0xff, rand() & 0xff, rand() & 0xff, rand() & 0xff, rand() & 0xff, rand() & 0xff);
+}
+
+static int check_shards(int device_count, bool sequential)
+{
+    hash_table* shards[shard_count];
+    for (int i = 0; i < shard_count; i++)
+        shards[i] = hash_table_init();
+
+    char* mac_addresses = (char*)malloc((size_t)device_count * 18);
+    for (int device = 0; device < device_count; device++) {
+        char* mac_address = mac_addresses + (size_t)device * 18;
+        make_mac_address(mac_address, device, sequential);
+
+        int shard = get_device_shard(mac_address);
+        if (shard < 0 || shard >= shard_count) {
+            printf("Shard %d for [%s] is out of range.\n", shard, mac_address);
+            return 1;
+        }
+        hash_table_put(shards[shard], mac_address, mac_address);
+    }
+
+    int failures = 0;
+    size_t worst_chain = 0;
+    double worst_use = 1;
+
+    for (int i = 0; i < shard_count; i++) {
+        size_t used, longest;
+        hash_table_stats(shards[i], &used, &longest);
+
+        // With n keys over b buckets, a uniform hash leaves each bucket
+        // empty with probability (1 - 1/b)^n.
+        double buckets = (double)shards[i]->bucket_count;
+        double expected_used = buckets * (1 - pow(1 - 1 / buckets, (double)shards[i]->count));
+        double use = (expected_used > 0) ? used / expected_used : 1;
+
+        if (use < worst_use)
+            worst_use = use;
+        if (longest > worst_chain)
+            worst_chain = longest;
+        if (use < min_bucket_use || longest > max_chain_len) {
+            printf("  shard %2d: %zu devices in %zu of %zu buckets (%.0f%% of expected), longest chain %zu\n",
+                i, shards[i]->count, used, shards[i]->bucket_count, use * 100, longest);
+            failures++;
+        }
+    }
+
+    printf("%-10s %8d devices   worst shard uses %5.1f%% of expected buckets, longest chain %zu\n",
+        sequential ? "sequential" : "random", device_count, worst_use * 100, worst_chain);
+
+    for (int i = 0; i < shard_count; i++)
+        hash_table_free(shards[i]);
+    free(mac_addresses);
+    return failures;
+}
+
+int main(int argc, char** argv)
+{
+    srand(1);
+
+    int failures = 0;
+    for (int i = 0; i < sizeof(device_counts) / sizeof(device_counts[0]); i++) {
+        failures += check_shards(device_counts[i], false);
+        failures += check_shards(device_counts[i], true);
+    }
+
+    if (failures > 0) {
+        printf("Devices were unevenly spread in %d shards.\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,445 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include "libwebsockets.h"
+#include "serialization.h"
+#include "scrape.h"
+#include "bench_util.h"
+
+// Opens a number of websocket clients on the ws-event protocol of a
+// running upkeep instance, then drives events through the ingest port and
+// measures how they fan out: how long each takes to reach each client,
+// how many never arrive, and how much server CPU each costs per client.
+//
+// Only reboots are broadcast, so every event is a report with an uptime
+// under five seconds.  Its description carries the run, the event's
+// sequence number and the time it was sent, which is how clients tell
+// this run's events apart from the device snapshot and time delivery.
+
+typedef struct ws_bench_options_t {
+    const char* host;
+    int port;
+    int ws_port;                    // Web interface, for both ws-event and /metrics
+    int clients;
+    int rate;                       // Events per second
+    int duration_sec;
+    int devices;
+    pid_t pid;
+} ws_bench_options_t;
+
+typedef struct ws_client_t {
+    struct lws* wsi;
+    bool established;
+    bool closed;
+    uint8_t* message;               // Fragments of the frame being received
+    size_t message_len;
+    size_t message_capacity;
+    uint8_t* received;              // One flag per event
+    uint64_t delivered;
+    uint64_t duplicates;
+} ws_client_t;
+
+static ws_bench_options_t options = {
+    "127.0.0.1", 12001, 15001,
+    100, 50, 10, 16, 0
+};
+
+static const int connect_timeout_sec = 10;
+static const int drain_sec = 2;                 // Keep listening this long after the last event
+static const char* description_prefix = "wsbench";
+
+// Delivery latencies in latency_bucket_us buckets, the last catching
+// everything slower.
+#define latency_bucket_us 10
+#define latency_bucket_count (1000 * 1000 / latency_bucket_us + 1)
+
+static uint64_t latency_buckets[latency_bucket_count];
+static uint64_t latency_max_ns = 0;
+
+static ws_client_t* clients;
+static uint64_t max_events;
+static uint64_t events_sent = 0;                // Written by the sender thread
+static bool sending_done = false;
+static int run_id;
+
+static void record_latency(uint64_t ns)
+{
+    uint64_t bucket = ns / 1000 / latency_bucket_us;
+    latency_buckets[(bucket < latency_bucket_count) ? bucket : latency_bucket_count - 1]++;
+    if (ns > latency_max_ns)
+        latency_max_ns = ns;
+}
+
+static double get_latency_quantile_us(uint64_t count, double quantile)
+{
+    uint64_t rank = (uint64_t)(quantile * count + 0.5);
+    uint64_t cumulative = 0;
+
+    for (int i = 0; i < latency_bucket_count - 1; i++) {
+        cumulative += latency_buckets[i];
+        if (cumulative >= rank && cumulative > 0)
+            return (i + 1) * latency_bucket_us;
+    }
+    return latency_max_ns / 1000.0;
+}
+
+// Sending
+
+static bool send_event(int fd, uint64_t sequence)
+{
+    int device = (int)(sequence % options.devices);
+
+    char mac_address[18];
+    char description[96];
+    snprintf(mac_address, sizeof(mac_address), "02:ff:00:00:%02x:%02x", (device >> 8) & 0xff, device & 0xff);
+    snprintf(description, sizeof(description), "%s %d %llu %llu", description_prefix, run_id,
+        (unsigned long long)sequence, (unsigned long long)now_ns());
+
+    uptime_report_view_t view = {
+        { mac_address, strlen(mac_address) },
+        { description, strlen(description) },
+        (uint32_t)(sequence % 1000)
+    };
+
+    uint8_t buf[256];
+    size_t len = get_report_view_size(&view);
+    size_t prefix_len = encode_varint(len, buf);
+    len = prefix_len + encode_report_view(&view, buf + prefix_len);
+
+    return send_all(fd, buf, len);
+}
+
+static void* run_sender(void* arg)
+{
+    int fd = connect_to(options.host, options.port);
+    if (fd < 0) {
+        printf("Could not connect to the ingest port %s:%d.\n", options.host, options.port);
+        __atomic_store_n(&sending_done, true, __ATOMIC_RELEASE);
+        return NULL;
+    }
+
+    uint64_t started_at = now_ns();
+    uint64_t interval_ns = 1000000000ull / options.rate;
+
+    for (uint64_t sequence = 0; sequence < max_events; sequence++) {
+        uint64_t deadline = started_at + sequence * interval_ns;
+        struct timespec ts = { (time_t)(deadline / 1000000000ull), (long)(deadline % 1000000000ull) };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+            ;
+
+        if (!send_event(fd, sequence))
+            break;
+        __atomic_store_n(&events_sent, sequence + 1, __ATOMIC_RELEASE);
+    }
+
+    close(fd);
+    __atomic_store_n(&sending_done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Receiving
+
+static void handle_report(ws_client_t* client, const uptime_report_view_t* view, uint64_t received_at)
+{
+    char description[96];
+    size_t len = (view->description.len < sizeof(description) - 1) ? view->description.len : sizeof(description) - 1;
+    memcpy(description, view->description.data, len);
+    description[len] = '\0';
+
+    char prefix[16];
+    int run;
+    unsigned long long sequence, sent_at;
+    if (sscanf(description, "%15s %d %llu %llu", prefix, &run, &sequence, &sent_at) != 4 ||
+        strcmp(prefix, description_prefix) != 0 || run != run_id || sequence >= max_events)
+        return;
+
+    if (client->received[sequence]) {
+        client->duplicates++;
+        return;
+    }
+
+    client->received[sequence] = 1;
+    client->delivered++;
+    record_latency(received_at - sent_at);
+}
+
+// A frame holds one or more reports, each preceded by its length.
+static void handle_message(ws_client_t* client)
+{
+    uint64_t received_at = now_ns();
+    size_t offset = 0;
+
+    while (offset < client->message_len) {
+        uint64_t report_len;
+        int prefix_len = decode_varint(client->message + offset, client->message_len - offset, &report_len);
+        if (prefix_len <= 0 || report_len > client->message_len - offset - prefix_len)
+            break;
+
+        uptime_report_view_t view;
+        if (decode_report_view(client->message + offset + prefix_len, report_len, &view) == REPORT_DECODE_OK)
+            handle_report(client, &view, received_at);
+
+        offset += prefix_len + report_len;
+    }
+}
+
+static void receive_fragment(ws_client_t* client, struct lws* wsi, const uint8_t* in, size_t len)
+{
+    if (client->message_len + len > client->message_capacity) {
+        client->message_capacity = (client->message_len + len) * 2;
+        client->message = (uint8_t*)realloc(client->message, client->message_capacity);
+    }
+    memcpy(client->message + client->message_len, in, len);
+    client->message_len += len;
+
+    if (lws_is_final_fragment(wsi) && 0 == lws_remaining_packet_payload(wsi)) {
+        handle_message(client);
+        client->message_len = 0;
+    }
+}
+
+static int callback_ws_event(struct lws* wsi, enum lws_callback_reasons reason, void* user, void* in, size_t len)
+{
+    ws_client_t* client = (ws_client_t*)user;
+
+    switch (reason) {
+        case LWS_CALLBACK_CLIENT_ESTABLISHED:
+            client->established = true;
+            break;
+        case LWS_CALLBACK_CLIENT_RECEIVE:
+            receive_fragment(client, wsi, (const uint8_t*)in, len);
+            break;
+        case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+        case LWS_CALLBACK_CLOSED:
+            if (client != NULL)
+                client->closed = true;
+            break;
+        default:
+            break;
+    }
+    return 0;
+}
+
+static struct lws_protocols protocols[] = {
+    { "ws-event", callback_ws_event, 0, 64 * 1024 },
+    { NULL, NULL, 0, 0 }
+};
+
+static struct lws_context* create_client_context()
+{
+    struct lws_context_creation_info info;
+    memset(&info, 0, sizeof info);
+
+    info.port = CONTEXT_PORT_NO_LISTEN;
+    info.protocols = protocols;
+    info.gid = -1;
+    info.uid = -1;
+
+    return lws_create_context(&info);
+}
+
+static void connect_client(struct lws_context* context, ws_client_t* client)
+{
+    struct lws_client_connect_info info;
+    memset(&info, 0, sizeof info);
+
+    info.context = context;
+    info.address = options.host;
+    info.port = options.ws_port;
+    info.path = "/";
+    info.host = options.host;
+    info.origin = options.host;
+    info.protocol = protocols[0].name;
+    info.ietf_version_or_minus_one = -1;
+    info.userdata = client;
+
+    client->wsi = lws_client_connect_via_info(&info);
+    if (NULL == client->wsi)
+        client->closed = true;
+}
+
+static int count_clients(bool established)
+{
+    int count = 0;
+    for (int i = 0; i < options.clients; i++) {
+        if (clients[i].established == established && !clients[i].closed)
+            count++;
+    }
+    return count;
+}
+
+static int connect_clients(struct lws_context* context)
+{
+    for (int i = 0; i < options.clients; i++)
+        connect_client(context, &clients[i]);
+
+    uint64_t deadline = now_ns() + (uint64_t)connect_timeout_sec * 1000000000ull;
+    while (count_clients(false) > 0 && now_ns() < deadline)
+        lws_service(context, 10);
+
+    return count_clients(true);
+}
+
+// Reporting
+
+static void print_usage(const char* name)
+{
+    printf("Usage: %s [options]\n"
+        "  -h host         upkeep host (%s)\n"
+        "  -p port         ingest port (%d)\n"
+        "  -w port         web interface port, for ws-event and /metrics (%d)\n"
+        "  -n clients      websocket clients (%d)\n"
+        "  -r rate         events per second (%d)\n"
+        "  -t seconds      how long to send for (%d)\n"
+        "  -d devices      devices the events are spread over (%d)\n"
+        "  -P pid          upkeep process, for CPU time; found by name if omitted\n",
+        name, options.host, options.port, options.ws_port, options.clients, options.rate,
+        options.duration_sec, options.devices);
+}
+
+static bool parse_options(int argc, char** argv)
+{
+    int option;
+    while ((option = getopt(argc, argv, "h:p:w:n:r:t:d:P:")) != -1) {
+        switch (option) {
+            case 'h': options.host = optarg; break;
+            case 'p': options.port = atoi(optarg); break;
+            case 'w': options.ws_port = atoi(optarg); break;
+            case 'n': options.clients = atoi(optarg); break;
+            case 'r': options.rate = atoi(optarg); break;
+            case 't': options.duration_sec = atoi(optarg); break;
+            case 'd': options.devices = atoi(optarg); break;
+            case 'P': options.pid = (pid_t)atoi(optarg); break;
+            default: return false;
+        }
+    }
+
+    return options.clients > 0 && options.rate > 0 && options.duration_sec > 0 && options.devices > 0;
+}
+
+static void print_results(int connected, uint64_t sent, double cpu_sec, const metrics_scrape_t* before, const metrics_scrape_t* after)
+{
+    uint64_t delivered = 0, duplicates = 0;
+    int disconnected = 0;
+    for (int i = 0; i < options.clients; i++) {
+        if (!clients[i].established)
+            continue;
+        delivered += clients[i].delivered;
+        duplicates += clients[i].duplicates;
+        if (clients[i].closed)
+            disconnected++;
+    }
+
+    uint64_t expected = sent * connected;
+    printf("\nEvents    %10llu sent to %d clients (%d of %d connected, %d disconnected during the run)\n",
+        (unsigned long long)sent, connected, connected, options.clients, disconnected);
+    printf("Delivered %10llu of %llu, %llu missing (%.3f%%), %llu duplicates\n",
+        (unsigned long long)delivered, (unsigned long long)expected, (unsigned long long)(expected - delivered),
+        expected > 0 ? 100.0 * (expected - delivered) / expected : 0.0, (unsigned long long)duplicates);
+
+    if (delivered > 0) {
+        printf("Latency   p50 %9.0f us   p99 %9.0f us   p99.9 %9.0f us   max %9.0f us\n",
+            get_latency_quantile_us(delivered, 0.5), get_latency_quantile_us(delivered, 0.99),
+            get_latency_quantile_us(delivered, 0.999), latency_max_ns / 1000.0);
+    }
+
+    if (options.pid > 0 && sent > 0 && connected > 0) {
+        printf("CPU       %10.2f s, %.1f us per event, %.2f us per event per client\n",
+            cpu_sec, cpu_sec * 1e6 / sent, cpu_sec * 1e6 / sent / connected);
+    } else {
+        printf("CPU       unknown; upkeep's pid was not found\n");
+    }
+
+    printf("Server    %10.0f broadcasts, %.0f frames sent, %.0f lagging clients\n",
+        get_scraped_value(after, "upkeep_broadcasts_total") - get_scraped_value(before, "upkeep_broadcasts_total"),
+        get_scraped_value(after, "upkeep_ws_frames_sent_total") - get_scraped_value(before, "upkeep_ws_frames_sent_total"),
+        get_scraped_value(after, "upkeep_ws_lagging_clients_total") - get_scraped_value(before, "upkeep_ws_lagging_clients_total"));
+
+    scraped_histogram_t before_histogram, after_histogram;
+    get_scraped_latencies(before, "broadcast_report", &before_histogram);
+    if (get_scraped_latencies(after, "broadcast_report", &after_histogram)) {
+        printf("broadcast_report p50 %.1f us   p99 %.1f us\n",
+            get_quantile_between(&before_histogram, &after_histogram, 0.5) * 1e6,
+            get_quantile_between(&before_histogram, &after_histogram, 0.99) * 1e6);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (!parse_options(argc, argv)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (0 == options.pid)
+        options.pid = find_process("upkeep");
+
+    run_id = (int)getpid();
+    max_events = (uint64_t)options.rate * options.duration_sec;
+
+    clients = (ws_client_t*)calloc(options.clients, sizeof(ws_client_t));
+    for (int i = 0; i < options.clients; i++)
+        clients[i].received = (uint8_t*)calloc(max_events, 1);
+
+    struct lws_context* context = create_client_context();
+    if (NULL == context) {
+        printf("Could not create the websocket client context.\n");
+        return 1;
+    }
+
+    int connected = connect_clients(context);
+    printf("Connected %d of %d websocket clients. Sending %d events/s over %d devices for %d s.\n",
+        connected, options.clients, options.rate, options.devices, options.duration_sec);
+    if (0 == connected) {
+        lws_context_destroy(context);
+        return 1;
+    }
+
+    metrics_scrape_t before, after;
+    if (!scrape_metrics(options.host, options.ws_port, &before)) {
+        printf("Could not read /metrics from %s:%d.\n", options.host, options.ws_port);
+        return 1;
+    }
+    double cpu_before = (options.pid > 0) ? get_process_cpu_seconds(options.pid) : 0;
+
+    pthread_t sender;
+    pthread_create(&sender, NULL, run_sender, NULL);
+
+    // Every client is serviced from this thread, so the receiving side
+    // needs no locking.
+    uint64_t drain_deadline = 0;
+    for (;;) {
+        lws_service(context, 10);
+
+        if (0 == drain_deadline && __atomic_load_n(&sending_done, __ATOMIC_ACQUIRE))
+            drain_deadline = now_ns() + (uint64_t)drain_sec * 1000000000ull;
+        if (drain_deadline > 0 && now_ns() >= drain_deadline)
+            break;
+    }
+
+    pthread_join(sender, NULL);
+    uint64_t sent = __atomic_load_n(&events_sent, __ATOMIC_ACQUIRE);
+    double cpu_sec = (options.pid > 0) ? get_process_cpu_seconds(options.pid) - cpu_before : 0;
+
+    if (!scrape_metrics(options.host, options.ws_port, &after)) {
+        printf("Lost /metrics after the run.\n");
+        return 1;
+    }
+
+    print_results(connected, sent, cpu_sec, &before, &after);
+
+    lws_context_destroy(context);
+    for (int i = 0; i < options.clients; i++) {
+        free(clients[i].message);
+        free(clients[i].received);
+    }
+    free(clients);
+    free_scrape(&before);
+    free_scrape(&after);
+    return 0;
+}
@@ -0,0 +1,27 @@
+#include <stddef.h>
+
+// Bump allocator.  Allocations are never freed individually; the whole
+// arena is rewound with arena_reset, which keeps its blocks for reuse, so
+// an arena that is reset after each unit of work stops allocating once it
+// has grown to fit the largest one.  Not thread-safe.
+typedef struct arena_block_t {
+    struct arena_block_t* next;
+    size_t size;
+    size_t used;
+    max_align_t data[];
+} arena_block_t;
+
+typedef struct arena {
+    arena_block_t* first;
+    arena_block_t* current;
+    size_t block_size;
+} arena;
+
+struct arena* arena_init(size_t block_size);
+void arena_free(struct arena* arena);
+
+// Memory is aligned for any type.
+void* arena_alloc(struct arena* arena, size_t size);
+
+// Invalidates everything allocated from the arena.
+void arena_reset(struct arena* arena);
@@ -0,0 +1,31 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "uv.h"
+
+// Fixed-capacity log of messages to broadcast.  Every appended entry gets
+// the next sequence number; readers keep their own cursor into the log, so
+// a slow reader never holds back the writer or other readers, and can tell
+// when the entry it wants has already been overwritten.
+typedef struct broadcast_log {
+    void** entries;
+    size_t capacity;
+    uint64_t head;          // Sequence number the next append will get
+    void (*free_entry)(void*);
+    uv_mutex_t lock;
+} broadcast_log;
+
+typedef enum {BROADCAST_READ_OK, BROADCAST_READ_EMPTY, BROADCAST_READ_LAGGING} broadcast_read_result;
+
+struct broadcast_log* broadcast_log_init(size_t capacity, void (*free_entry)(void*));
+void broadcast_log_free(struct broadcast_log* log);
+
+// Takes ownership of entry.  Returns the entry's sequence number.
+uint64_t broadcast_log_append(struct broadcast_log* log, void* entry);
+
+uint64_t broadcast_log_head(struct broadcast_log* log);
+
+// Hands the entry at *cursor to fptr (with the log locked) and advances the
+// cursor.  Returns BROADCAST_READ_LAGGING, without calling fptr, if the
+// entry has already been overwritten.
+broadcast_read_result broadcast_log_read(struct broadcast_log* log, uint64_t* cursor, void (*fptr)(void*, void*), void* args);
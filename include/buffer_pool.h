@@ -0,0 +1,27 @@
+#include <stddef.h>
+#include <stdint.h>
+
+// Free list of equally sized buffers.  A pool is not thread-safe; give
+// each loop its own.  The hit and miss counters may be read from other
+// threads with buffer_pool_stats.
+typedef struct buffer_pool {
+    size_t buffer_size;
+    size_t max_free;        // Buffers beyond this are returned to the allocator
+    size_t free_count;
+    void* free_list;
+    uint64_t hits;
+    uint64_t misses;
+} buffer_pool;
+
+struct buffer_pool* buffer_pool_init(size_t buffer_size, size_t max_free);
+
+// Only the free buffers are released; any still handed out must be given
+// back first or they are leaked.
+void buffer_pool_free(struct buffer_pool* pool);
+
+// Returns a buffer of pool->buffer_size bytes, reusing a free one if any.
+void* buffer_pool_get(struct buffer_pool* pool);
+
+void buffer_pool_put(struct buffer_pool* pool, void* buffer);
+
+void buffer_pool_stats(struct buffer_pool* pool, uint64_t* hits, uint64_t* misses);
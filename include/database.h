@@ -5,6 +5,21 @@
 static char* SQLite_db_directory = "/opt/upkeep/db/";    // yeah, whatever
 static char* SQLite_db_filepath = "/opt/upkeep/db/upkeep.sqlite";
 
+// Write-behind durability bound.  Queued entries are committed in a single
+// transaction once this many are pending, or once the oldest of them has
+// waited this long, whichever comes first.
+static const int write_behind_max_batch = 500;
+static const int write_behind_max_delay_ms = 1000;
+
+// Hard cap on entries waiting to be committed, should the database fall
+// behind.  Past it, queue_uptime_entry still updates the device's state
+// but drops the entry from the history and counts it in
+// upkeep_entries_dropped_total.
+static const int write_behind_max_pending = 100 * write_behind_max_batch;
+
+// A device is considered down once it has gone this long without reporting.
+static const int outage_threshold_sec = 120;
+
 typedef struct uptime_entry_t {
     char* mac_address;
     char* description;
@@ -16,8 +31,32 @@ typedef list uptime_record;
 void uptime_record_foreach(uptime_record* collection, void (*fptr)(uptime_entry_t*, void*), void* args);
 
 void init_database();
+// Same, with the database somewhere other than SQLite_db_filepath.
+void init_database_at(const char* directory, const char* filepath);
+void shutdown_database();
 uptime_record* get_uptime_record();
 uint32_t get_last_known_uptime(const char* mac_address);
+
+// Visits every device's state as it is streamed to websocket clients: a
+// serialized report preceded by its length as a varint.  It is kept
+// current as devices report, so nothing is serialized here.  fptr runs
+// with the device table read-locked and must not call back in.
+void device_state_foreach_serialized(void (*fptr)(const uint8_t* data, size_t len, void* args), void* args);
+
+// Which shard of the device table holds the device's state.
+int get_device_shard(const char* mac_address);
+
+// Changes whenever any device state changes.
+uint64_t get_device_state_generation();
 void insert_uptime_entry(uptime_entry_t* entry);
+
+// Hands each device whose outage deadline has passed since the last call
+// to fptr, once per outage.  A device is re-armed when it next reports.
+// fptr gets a copy of the device's state and runs with no locks held.
+void check_for_outages(time_t current_time, void (*fptr)(uptime_entry_t*, void*), void* args);
+// Takes its own copy of the entry.
+void queue_uptime_entry(uptime_entry_t* entry);
+void flush_uptime_entries();
+uptime_entry_t* copy_uptime_entry_t(uptime_entry_t* entry);
 void free_uptime_entry_t(uptime_entry_t* entry);
 void free_uptime_record(uptime_record* records);
\ No newline at end of file
@@ -0,0 +1,36 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct hash_entry_t {
+    const char* key;
+    void* data;
+    struct hash_entry_t* next;
+} hash_entry_t;
+
+typedef struct hash_table {
+    hash_entry_t** buckets;
+    size_t bucket_count;
+    size_t count;
+} hash_table;
+
+struct hash_table* hash_table_init();
+
+// Caller responsible for freeing keys and data.
+void hash_table_free(struct hash_table* table);
+
+// Caller responsible for allocation of key and data.  The key must stay
+// valid for as long as the entry is in the table.  Replaces (and returns)
+// any existing data stored under the same key, NULL otherwise.
+void* hash_table_put(struct hash_table* table, const char* key, void* data);
+
+void* hash_table_get(struct hash_table* table, const char* key);
+
+// Returns the data that was removed, or NULL if the key was not present.
+void* hash_table_remove(struct hash_table* table, const char* key);
+
+size_t hash_string(const char* key);
+
+// How many buckets hold at least one entry, and the most any one holds.
+void hash_table_stats(struct hash_table* table, size_t* used_buckets, size_t* longest_chain);
+
+void hash_table_foreach(struct hash_table* table, void (*fptr)(void*, void*), void* args);
@@ -0,0 +1,40 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "uv.h"
+
+// Devices report over TCP as a stream of uptime_report_msg, each preceded
+// by its length as a base 128 varint, so any number of reports can be
+// sent back to back on one connection.  A connection that announces a
+// report longer than max_report_len is dropped.
+static const size_t max_report_len = 4096;
+
+// Connections that send nothing for connection_idle_timeout_ms are closed.
+// Past max_connections, new connections are closed as soon as they are
+// accepted.
+static const uint64_t connection_idle_timeout_ms = 10 * 60 * 1000;
+static const int max_connections = 65536;
+
+struct uptime_report_t;
+
+// on_report is called on the loop that received the report.  With a
+// thread_count above one, that many threads each run their own loop and
+// SO_REUSEPORT listener, so on_report must be thread-safe.
+bool listen_for_reports(const char* ip_addr, int port, int thread_count, void (*on_report)(struct uptime_report_t*, uv_loop_t*));
+
+// Optional fire-and-forget ingest.  Each datagram holds one or more whole
+// reports in the same length-prefixed format as the TCP stream.
+bool listen_for_datagrams(const char* ip_addr, int port, void (*on_report)(struct uptime_report_t*, uv_loop_t*));
+
+// Stops the ingest threads and waits for them to exit, so nothing is
+// handed to on_report once this returns.  Call before shutting down
+// anything on_report uses.
+void shutdown_ingest();
+
+// Read buffers handed out from the per-loop pools, summed over all ingest
+// loops.  A miss is a fresh allocation.
+void get_read_buffer_stats(uint64_t* hits, uint64_t* misses);
+
+// Open connections across all ingest loops, and how many have been turned
+// away at max_connections or closed for being idle.
+void get_connection_stats(int* active, uint64_t* rejected, uint64_t* timed_out);
@@ -1,4 +1,5 @@
 #include <stdbool.h>
+#include <stdint.h>
 
 static char* zlog_category_str = "upkeep_log";
 static char* zlog_config_filepath = "./zlog.conf";
@@ -6,10 +7,32 @@ static char* zlog_error_filepath = "/tmp/zlog_error.txt";
 
 typedef enum {DEBUG, INFO, WARN, ERROR, FATAL} log_type;
 
+// What log_info and friends do when the queue of unwritten logs is full:
+// drop the message and count it, or write out the queue on the calling
+// thread before queueing.
+typedef enum {LOG_OVERFLOW_DROP, LOG_OVERFLOW_BLOCK} log_overflow_policy;
+static const log_overflow_policy log_overflow = LOG_OVERFLOW_DROP;
+
+// When set, log_info and friends copy their raw arguments and leave the
+// formatting to the log writer thread.  Format strings must then stay
+// valid for the life of the program, which string literals do.
+static const bool log_deferred_formatting = true;
+
+// Each call site of log_info and friends may log log_rate_limit_per_sec
+// messages a second on average, in bursts of up to log_rate_limit_burst.
+// Messages past that are counted and summarized once the site gets a
+// message through again.  Consecutive identical messages are collapsed
+// into a "Last message repeated N times" line.
+static const int log_rate_limit_per_sec = 50;
+static const int log_rate_limit_burst = 200;
+
 void log_synchronous (log_type type, const char* msg, ...);
 void log_info (const char* msg, ...);
 void log_warn (const char* msg, ...);
 void log_error (const char* msg, ...);
 void force_log_flush();
+uint64_t get_dropped_log_count();
+uint64_t get_log_queue_depth();     // Messages queued but not yet written
+void get_suppressed_log_counts(uint64_t* rate_limited, uint64_t* repeated);
 bool init_logger();
 void shutdown_logger();
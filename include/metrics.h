@@ -0,0 +1,83 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Process-wide counters and per-stage latency histograms, exposed in the
+// Prometheus text format.  Every thread records into its own block, so
+// recording is a handful of uncontended stores and is left on in
+// production; blocks are only summed when metrics are rendered.
+typedef enum {
+    METRIC_CONNECTIONS_ACCEPTED,
+    METRIC_CONNECTIONS_REFUSED,
+    METRIC_READS,
+    METRIC_BYTES_READ,
+    METRIC_DATAGRAMS_RECEIVED,
+    METRIC_DATAGRAMS_DROPPED,
+    METRIC_REPORTS_DECODED,
+    METRIC_DECODE_FAILURES,
+    METRIC_REBOOTS_DETECTED,
+    METRIC_OUTAGES_DETECTED,
+    METRIC_ENTRIES_COMMITTED,
+    METRIC_ENTRIES_DROPPED,
+    METRIC_BROADCASTS,
+    METRIC_WS_FRAMES_SENT,
+    METRIC_WS_LAGGING_CLIENTS,
+    METRIC_COUNTER_COUNT
+} metric_counter;
+
+// Stages are timed with a monotonic clock into log-linear histograms that
+// keep every sample to within 12.5%.
+typedef enum {
+    STAGE_ACCEPT,
+    STAGE_READ,
+    STAGE_ASSEMBLE_REPORT,          // First byte of a report split across reads to its last
+    STAGE_DESERIALIZE_REPORT,
+    STAGE_REGISTER_UPTIME_REPORT,   // The whole report handler
+    STAGE_GET_LAST_KNOWN_UPTIME,
+    STAGE_QUEUE_UPTIME_ENTRY,
+    STAGE_REBOOT_QUEUE_WAIT,        // Queued reboot work waiting for a thread
+    STAGE_INSERT_UPTIME_ENTRY,      // Per transaction, so a whole write-behind batch
+    STAGE_COMMIT_WAIT,              // Per entry, from queue_uptime_entry to its commit
+    STAGE_BROADCAST_REPORT,
+    METRIC_STAGE_COUNT
+} metric_stage;
+
+typedef struct metrics_latency_summary {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t p50_ns;
+    uint64_t p90_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+} metrics_latency_summary;
+
+// Growable text that metrics are rendered into.
+typedef struct metrics_text {
+    char* data;
+    size_t len;
+    size_t capacity;
+} metrics_text;
+
+void metrics_count(metric_counter counter, uint64_t n);
+
+// Monotonic clock in nanoseconds, to pass back to metrics_record_latency.
+uint64_t metrics_now();
+
+// Records the time since started_at, taken from metrics_now, for stage.
+void metrics_record_latency(metric_stage stage, uint64_t started_at);
+void metrics_record_interval(metric_stage stage, uint64_t started_at, uint64_t ended_at);
+
+// Merges the histograms of every thread for stage.
+void metrics_summarize_latency(metric_stage stage, struct metrics_latency_summary* summary);
+const char* metrics_stage_name(metric_stage stage);
+
+// Appends every counter and histogram, summed over all threads.
+void metrics_render(struct metrics_text* text);
+
+// For callers adding metrics kept elsewhere to the rendered text.  type
+// is the Prometheus metric type, "counter" or "gauge".
+void metrics_append(struct metrics_text* text, const char* format, ...);
+void metrics_append_value(struct metrics_text* text, const char* name, const char* type, const char* help, double value);
+
+void metrics_text_free(struct metrics_text* text);
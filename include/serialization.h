@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 typedef struct uptime_report_t {
     char* mac_address;
@@ -7,6 +8,59 @@ typedef struct uptime_report_t {
     uint32_t uptime;
 } uptime_report_t;
 
-uptime_report_t* deserialize_report (const char* buffer, int len);
-uint8_t* serialize_report (uptime_report_t* unit);
-void free_uptime_report_t(uptime_report_t* report);
\ No newline at end of file
+struct arena;
+
+typedef struct string_view_t {
+    const char* data;       // Not NUL-terminated
+    size_t len;
+} string_view_t;
+
+// uptime_report_msg as it sits in the wire buffer.  The strings point into
+// the buffer that was decoded.
+typedef struct uptime_report_view_t {
+    string_view_t mac_address;
+    string_view_t description;
+    uint32_t uptime;
+} uptime_report_view_t;
+
+typedef enum {
+    REPORT_DECODE_OK,
+    REPORT_DECODE_MALFORMED,        // Truncated, or missing a required field
+    REPORT_DECODE_UNRECOGNIZED      // Has fields the schema-specific decoder does not know
+} report_decode_result;
+
+// Decodes uptime_report_msg without allocating or going through protobuf-c.
+// Anything it does not recognize is left for protobuf-c to make sense of.
+report_decode_result decode_report_view(const uint8_t* buf, size_t len, uptime_report_view_t* view);
+
+size_t get_report_view_size(const uptime_report_view_t* view);
+
+// out must hold get_report_view_size bytes.  Returns the number written.
+size_t encode_report_view(const uptime_report_view_t* view, uint8_t* out);
+
+// The report and its strings are allocated from the arena and are only
+// valid until it is next reset.
+uptime_report_t* deserialize_report (const char* buffer, int len, struct arena* arena);
+
+// The exact number of bytes serialize_report_to_buffer will write.
+size_t get_serialized_report_size(const uptime_report_t* unit);
+
+// Packs the report into buf, for instance straight into an outgoing frame.
+// Returns the number of bytes written, or 0 if capacity is too small.
+size_t serialize_report_to_buffer(const uptime_report_t* unit, uint8_t* buf, size_t capacity);
+
+// Same, into a buffer of exactly the right size that the caller frees.
+uint8_t* serialize_report (const uptime_report_t* unit, size_t* len);
+
+// For reports whose strings were malloc'd; never for deserialized ones.
+void free_uptime_report_t(uptime_report_t* report);
+
+// Reports sent as a stream are each preceded by their length as a
+// protobuf-style base 128 varint.
+static const size_t max_varint_len = 10;
+size_t encode_varint(uint64_t value, uint8_t* out);
+size_t get_varint_size(uint64_t value);
+
+// Returns the number of bytes read, 0 if buf ends partway through the
+// varint, or -1 if it is longer than any valid varint.
+int decode_varint(const uint8_t* buf, size_t len, uint64_t* value);
\ No newline at end of file
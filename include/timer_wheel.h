@@ -0,0 +1,36 @@
+#include <stddef.h>
+#include <time.h>
+
+// Intrusive node; embed one in whatever needs a deadline.  A node is
+// scheduled on at most one wheel at a time.
+typedef struct timer_wheel_node_t {
+    time_t deadline;
+    void* data;
+    struct timer_wheel_node_t* prev;
+    struct timer_wheel_node_t* next;
+} timer_wheel_node_t;
+
+// Hashed timing wheel with one-second slots.  Deadlines further out than
+// slot_count seconds are legal, they just get skipped over until due.
+typedef struct timer_wheel {
+    timer_wheel_node_t* slots;
+    size_t slot_count;
+    time_t current;
+} timer_wheel;
+
+// slot_count must be a power of two.
+struct timer_wheel* timer_wheel_init(size_t slot_count, time_t now);
+
+// Caller responsible for freeing nodes.
+void timer_wheel_free(struct timer_wheel* wheel);
+
+void timer_wheel_node_init(timer_wheel_node_t* node, void* data);
+
+// Schedules the node, moving it if it is already scheduled.
+void timer_wheel_schedule(struct timer_wheel* wheel, timer_wheel_node_t* node, time_t deadline);
+
+void timer_wheel_cancel(timer_wheel_node_t* node);
+
+// Unschedules and hands every node whose deadline is at or before now to
+// fptr.  Only the slots between the last call and now are visited.
+void timer_wheel_advance(struct timer_wheel* wheel, time_t now, void (*fptr)(timer_wheel_node_t*, void*), void* args);
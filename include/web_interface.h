@@ -1,5 +1,16 @@
 static const int websocket_port = 15001;
 static char* static_content_subdirectory = "static_content/";
 
-void init_webserver();
+// Number of broadcasts retained for websocket clients.  A client that falls
+// further behind than this is handled according to ws_lagging_client_policy.
+typedef enum {LAGGING_CLIENT_RESYNC, LAGGING_CLIENT_DISCONNECT} lagging_client_policy;
+static const int ws_broadcast_log_capacity = 1024;
+static const lagging_client_policy ws_lagging_client_policy = LAGGING_CLIENT_RESYNC;
+
+struct uptime_report_t;
+
+// on_terminate_signal is invoked on the loop thread for termination signals
+// that the websocket server intercepts.
+void init_webserver(void (*on_terminate_signal)(int));
+void broadcast_report(struct uptime_report_t* data);
 void shutdown_webserver();
\ No newline at end of file
@@ -1,7 +1,13 @@
 #!/bin/sh
 
+# libwebsockets is configured against the vendored libuv so that it can be
+# serviced directly from upkeep's event loop (LWS_WITH_LIBUV).  Build libuv
+# first.
 cd "$(dirname "$0")"
+LIBUV_DIR="$(cd ../../libuv/ && pwd)"
 mkdir -p ../../libwebsockets/build
-yes | cp -rf ./Makefile ../../libwebsockets/build/
 cd ../../libwebsockets/build/
+cmake .. -DLWS_WITH_LIBUV=ON \
+         -DLWS_LIBUV_INCLUDE_DIRS="$LIBUV_DIR/include" \
+         -DLWS_LIBUV_LIBRARIES="$LIBUV_DIR/.libs/libuv.a"
 make
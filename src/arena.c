@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "arena.h"
+
+static size_t align_up(size_t size)
+{
+    return (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+}
+
+static arena_block_t* alloc_block(size_t size)
+{
+    arena_block_t* block = (arena_block_t*)malloc(sizeof(arena_block_t) + size);
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+struct arena* arena_init(size_t block_size)
+{
+    struct arena* arena = (struct arena*)calloc(1, sizeof(struct arena));
+    arena->block_size = align_up(block_size);
+    arena->first = alloc_block(arena->block_size);
+    arena->current = arena->first;
+    return arena;
+}
+
+void arena_free(struct arena* arena)
+{
+    if (NULL == arena)
+        return;
+
+    arena_block_t* block = arena->first;
+    while (block != NULL) {
+        arena_block_t* next = block->next;
+        free(block);
+        block = next;
+    }
+
+    free(arena);
+}
+
+void* arena_alloc(struct arena* arena, size_t size)
+{
+    size = align_up(size);
+
+    // Move on through the blocks kept from earlier rounds before growing.
+    // A block that is skipped over stays unused until the next reset.
+    arena_block_t* block = arena->current;
+    while (block->size - block->used < size) {
+        if (NULL == block->next) {
+            arena_block_t* added = alloc_block((size > arena->block_size) ? size : arena->block_size);
+            block->next = added;
+        }
+        block = block->next;
+    }
+
+    arena->current = block;
+    void* ptr = (char*)block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+void arena_reset(struct arena* arena)
+{
+    for (arena_block_t* block = arena->first; block != NULL; block = block->next)
+        block->used = 0;
+    arena->current = arena->first;
+}
@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "broadcast_log.h"
+
+struct broadcast_log* broadcast_log_init(size_t capacity, void (*free_entry)(void*))
+{
+    struct broadcast_log* log = (struct broadcast_log*)calloc(1, sizeof(struct broadcast_log));
+    log->entries = (void**)calloc(capacity, sizeof(void*));
+    log->capacity = capacity;
+    log->head = 0;
+    log->free_entry = free_entry;
+    uv_mutex_init(&log->lock);
+    return log;
+}
+
+void broadcast_log_free(struct broadcast_log* log)
+{
+    if (NULL == log)
+        return;
+
+    for (size_t i = 0; i < log->capacity; i++) {
+        if (log->entries[i] != NULL && log->free_entry != NULL)
+            log->free_entry(log->entries[i]);
+    }
+
+    uv_mutex_destroy(&log->lock);
+    free(log->entries);
+    free(log);
+}
+
+uint64_t broadcast_log_append(struct broadcast_log* log, void* entry)
+{
+    uv_mutex_lock(&log->lock);
+
+    uint64_t seq = log->head++;
+    void** slot = &log->entries[seq % log->capacity];
+    if (*slot != NULL && log->free_entry != NULL)
+        log->free_entry(*slot);
+    *slot = entry;
+
+    uv_mutex_unlock(&log->lock);
+
+    return seq;
+}
+
+uint64_t broadcast_log_head(struct broadcast_log* log)
+{
+    uv_mutex_lock(&log->lock);
+    uint64_t head = log->head;
+    uv_mutex_unlock(&log->lock);
+    return head;
+}
+
+broadcast_read_result broadcast_log_read(struct broadcast_log* log, uint64_t* cursor, void (*fptr)(void*, void*), void* args)
+{
+    broadcast_read_result result;
+
+    uv_mutex_lock(&log->lock);
+
+    if (*cursor >= log->head) {
+        result = BROADCAST_READ_EMPTY;
+    } else if (log->head - *cursor > log->capacity) {
+        result = BROADCAST_READ_LAGGING;
+    } else {
+        (*fptr)(log->entries[*cursor % log->capacity], args);
+        (*cursor)++;
+        result = BROADCAST_READ_OK;
+    }
+
+    uv_mutex_unlock(&log->lock);
+
+    return result;
+}
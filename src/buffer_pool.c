@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "buffer_pool.h"
+
+// Free buffers are chained through their own first bytes.
+typedef struct free_buffer_t {
+    struct free_buffer_t* next;
+} free_buffer_t;
+
+struct buffer_pool* buffer_pool_init(size_t buffer_size, size_t max_free)
+{
+    struct buffer_pool* pool = (struct buffer_pool*)calloc(1, sizeof(struct buffer_pool));
+    pool->buffer_size = (buffer_size < sizeof(free_buffer_t)) ? sizeof(free_buffer_t) : buffer_size;
+    pool->max_free = max_free;
+    return pool;
+}
+
+void buffer_pool_free(struct buffer_pool* pool)
+{
+    if (NULL == pool)
+        return;
+
+    free_buffer_t* buffer = (free_buffer_t*)pool->free_list;
+    while (buffer != NULL) {
+        free_buffer_t* next = buffer->next;
+        free(buffer);
+        buffer = next;
+    }
+
+    free(pool);
+}
+
+// The counters are only ever written by the pool's own thread, so a
+// relaxed store of the incremented value is enough for other threads to
+// read them without tearing.
+static void count(uint64_t* counter)
+{
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+void* buffer_pool_get(struct buffer_pool* pool)
+{
+    free_buffer_t* buffer = (free_buffer_t*)pool->free_list;
+
+    if (NULL == buffer) {
+        count(&pool->misses);
+        return malloc(pool->buffer_size);
+    }
+
+    pool->free_list = buffer->next;
+    pool->free_count--;
+    count(&pool->hits);
+    return buffer;
+}
+
+void buffer_pool_put(struct buffer_pool* pool, void* buffer)
+{
+    if (NULL == buffer)
+        return;
+
+    if (pool->free_count >= pool->max_free) {
+        free(buffer);
+        return;
+    }
+
+    ((free_buffer_t*)buffer)->next = (free_buffer_t*)pool->free_list;
+    pool->free_list = buffer;
+    pool->free_count++;
+}
+
+void buffer_pool_stats(struct buffer_pool* pool, uint64_t* hits, uint64_t* misses)
+{
+    *hits = __atomic_load_n(&pool->hits, __ATOMIC_RELAXED);
+    *misses = __atomic_load_n(&pool->misses, __ATOMIC_RELAXED);
+}
@@ -6,7 +6,12 @@
 #include <unistd.h>
 #include <time.h>
 #include "sqlite3.h"
+#include "uv.h"
 #include "logger.h"
+#include "hash_table.h"
+#include "timer_wheel.h"
+#include "metrics.h"
+#include "serialization.h"
 #include "database.h"
 
 bool create_directory(const char* fullPath)
@@ -23,23 +28,246 @@ bool create_directory(const char* fullPath)
     return false;
 }
 
+// A single long-lived connection is shared by every caller, along with
+// the statements used on the hot paths.  Statements are prepared once
+// in init_database() and reset/rebound on each use.
+static sqlite3* db = NULL;
+static sqlite3_stmt* insert_stmt = NULL;
+static sqlite3_stmt* begin_stmt = NULL;
+static sqlite3_stmt* commit_stmt = NULL;
+static sqlite3_stmt* select_all_stmt = NULL;
+static uv_mutex_t db_lock;
+
+// In-memory device state, keyed by mac address.  This is loaded from the
+// uptime table once in init_database() and is the source of truth for
+// every read afterwards; SQLite is only written to for persistence.
+//
+// Every device sits on its shard's outage wheel at last_update +
+// outage_threshold_sec and is moved each time it reports, so an outage
+// check only ever touches devices whose deadline has actually passed.
+//
+// Each device also keeps its state serialized the way it is streamed to
+// websocket clients, rewritten in place whenever the device reports, so a
+// snapshot of every device is a copy rather than a re-serialization.
+typedef struct device_state_t {
+    uptime_entry_t entry;
+    timer_wheel_node_t outage_node;
+    uint8_t* serialized;
+    size_t serialized_len;
+    size_t serialized_capacity;
+} device_state_t;
+
+// Devices are split across shards by mac address so that ingest threads
+// reporting for different devices rarely contend on the same lock.  The
+// shard is picked from the top bits of the hash, since each shard's hash
+// table picks its bucket from the bottom ones.
+#define device_shard_bits 4
+#define device_shard_count (1 << device_shard_bits)
+
+typedef struct device_shard_t {
+    hash_table* devices;
+    timer_wheel* outage_wheel;
+    uv_rwlock_t lock;
+} device_shard_t;
+
+static device_shard_t device_shards[device_shard_count];
+static uint64_t devices_generation = 0;     // Bumped (atomically) on every change
+static const size_t outage_wheel_slots = 512;
+
+// Write-behind state.  Entries can be queued from any thread and are
+// committed in one transaction on the libuv thread pool; the timer and
+// work requests are only ever touched from the default loop.  Only one batch is ever in
+// flight so that batches land in the order they were queued.
+static list* pending_entries = NULL;
+static int pending_count = 0;
+static bool commit_in_flight = false;
+static bool dropping_entries = false;    // Past write_behind_max_pending, so the first drop is logged
+static uv_mutex_t pending_lock;
+static uv_cond_t commit_done;
+static uv_timer_t write_behind_timer;
+static uv_async_t write_behind_async;    // Lets any thread poke the default loop
+
+// A queued entry and when it was queued.  The entry must stay first so
+// that a batch can be committed and freed as a plain uptime_record.
+typedef struct pending_entry_t {
+    uptime_entry_t entry;
+    uint64_t queued_at;
+} pending_entry_t;
+
+static void on_write_behind_timer(uv_timer_t* handle);
+static void on_write_behind_async(uv_async_t* handle);
+static void on_commit_thread_done(uv_work_t* req, int status);
+
+static void copy_uptime_entry_into(uptime_entry_t* copy, uptime_entry_t* entry)
+{
+    copy->mac_address = strdup(entry->mac_address);
+    copy->description = strdup(entry->description);
+    copy->uptime = entry->uptime;
+    copy->last_update = entry->last_update;
+}
+
+uptime_entry_t* copy_uptime_entry_t(uptime_entry_t* entry)
+{
+    uptime_entry_t* copy = (uptime_entry_t*)malloc(sizeof(uptime_entry_t));
+    copy_uptime_entry_into(copy, entry);
+    return copy;
+}
+
+static void free_device_state(void* data, void* args)
+{
+    device_state_t* state = (device_state_t*)data;
+    free(state->entry.mac_address);
+    free(state->entry.description);
+    free(state->serialized);
+    free(state);
+}
+
+int get_device_shard(const char* mac_address)
+{
+    return (int)(hash_string(mac_address) >> (sizeof(size_t) * 8 - device_shard_bits));
+}
+
+static device_shard_t* shard_for(const char* mac_address)
+{
+    return &device_shards[get_device_shard(mac_address)];
+}
+
+// The report preceded by its length.  Must be called with the shard's lock
+// held for writing.
+static void serialize_device_state(device_state_t* state)
+{
+    uptime_report_t report = { state->entry.mac_address, state->entry.description, state->entry.uptime };
+    size_t len = get_serialized_report_size(&report);
+    size_t needed = get_varint_size(len) + len;
+
+    if (needed > state->serialized_capacity) {
+        state->serialized = (uint8_t*)realloc(state->serialized, needed);
+        state->serialized_capacity = needed;
+    }
+
+    state->serialized_len = encode_varint(len, state->serialized);
+    state->serialized_len += serialize_report_to_buffer(&report, state->serialized + state->serialized_len, len);
+}
+
+// Must be called with the shard's lock held for writing.
+static device_state_t* add_device_state(device_shard_t* shard, uptime_entry_t* entry)
+{
+    device_state_t* state = (device_state_t*)malloc(sizeof(device_state_t));
+    state->entry.mac_address = strdup(entry->mac_address);
+    state->entry.description = strdup(entry->description);
+    state->entry.uptime = entry->uptime;
+    state->entry.last_update = entry->last_update;
+
+    state->serialized = NULL;
+    state->serialized_capacity = 0;
+    serialize_device_state(state);
+
+    timer_wheel_node_init(&state->outage_node, state);
+    timer_wheel_schedule(shard->outage_wheel, &state->outage_node, entry->last_update + outage_threshold_sec);
+
+    hash_table_put(shard->devices, state->entry.mac_address, state);
+    return state;
+}
+
+static void update_device_state(uptime_entry_t* entry)
+{
+    device_shard_t* shard = shard_for(entry->mac_address);
+
+    uv_rwlock_wrlock(&shard->lock);
+
+    device_state_t* state = (device_state_t*)hash_table_get(shard->devices, entry->mac_address);
+    if (NULL == state) {
+        add_device_state(shard, entry);
+    } else {
+        if (strcmp(state->entry.description, entry->description) != 0) {
+            free(state->entry.description);
+            state->entry.description = strdup(entry->description);
+        }
+        state->entry.uptime = entry->uptime;
+        state->entry.last_update = entry->last_update;
+        serialize_device_state(state);
+        timer_wheel_schedule(shard->outage_wheel, &state->outage_node, entry->last_update + outage_threshold_sec);
+    }
+
+    uv_rwlock_wrunlock(&shard->lock);
+
+    __atomic_add_fetch(&devices_generation, 1, __ATOMIC_RELEASE);
+}
+
+static int count_devices()
+{
+    size_t count = 0;
+    for (int i = 0; i < device_shard_count; i++)
+        count += device_shards[i].devices->count;
+    return (int)count;
+}
+
+static void prepare_statement(const char* query, sqlite3_stmt** stmt)
+{
+    int prepare = sqlite3_prepare_v2(db, query, -1, stmt, NULL);
+    if (prepare != SQLITE_OK) {
+        log_synchronous(ERROR, "init_database: Failed to prepare the query [%s]. "
+            "SQLite Error: %d", query, prepare);
+        _exit(SIGTERM);
+    }
+}
+
+static void load_device_states()
+{
+    for (int i = 0; i < device_shard_count; i++) {
+        device_shards[i].devices = hash_table_init();
+        device_shards[i].outage_wheel = timer_wheel_init(outage_wheel_slots, time(NULL));
+        uv_rwlock_init(&device_shards[i].lock);
+    }
+
+    int step;
+    while((step = sqlite3_step(select_all_stmt)) == SQLITE_ROW) {
+        char* description = (char*)sqlite3_column_text(select_all_stmt, 1);
+
+        uptime_entry_t record;
+        record.mac_address  = (char*)sqlite3_column_text(select_all_stmt, 0);
+        record.description  = (NULL != description) ? description : "";
+        record.uptime       = sqlite3_column_int(select_all_stmt, 2);                    // unchecked
+        record.last_update  = (time_t)sqlite3_column_int64(select_all_stmt, 3);
+
+        add_device_state(shard_for(record.mac_address), &record);
+    }
+
+    sqlite3_reset(select_all_stmt);
+
+    if (step != SQLITE_DONE) {
+        log_synchronous(ERROR, "init_database: Failed to load the uptime table. "
+            "SQLite Error: %d", step);
+        _exit(SIGTERM);
+    }
+}
+
 void init_database()
 {
-    sqlite3* db;
+    init_database_at(SQLite_db_directory, SQLite_db_filepath);
+}
+
+void init_database_at(const char* directory, const char* filepath)
+{
     static const char* create_table_script = "CREATE TABLE IF NOT EXISTS uptime ("
             "mac_address TEXT PRIMARY KEY ON CONFLICT REPLACE, "
             "description TEXT, uptime TEXT, last_update INTEGER)";
 
-    if (!create_directory(SQLite_db_directory))
+    if (NULL != db)
+        return;
+
+    if (!create_directory(directory))
         _exit(SIGTERM);
 
-    int open = sqlite3_open(SQLite_db_filepath, &db);
+    int open = sqlite3_open(filepath, &db);
     if (open != SQLITE_OK) {
         log_synchronous(ERROR, "init_database: Failed to open the database at [%s]. "
-            "SQLite Error: %d", SQLite_db_filepath, open);
+            "SQLite Error: %d", filepath, open);
         _exit(SIGTERM);
     }
 
+    sqlite3_busy_timeout(db, 100);  // Wait 100 ms for the lock
+
     int create_table = sqlite3_exec(db, create_table_script, NULL, NULL, NULL);
     if (create_table != SQLITE_OK) {
         log_synchronous(ERROR, "init_database: Failed to setup tables in the database. "
@@ -47,133 +275,292 @@ void init_database()
         _exit(SIGTERM);
     }
 
-    sqlite3_close(db);
+    prepare_statement("INSERT INTO uptime VALUES (@mac_address, @description, @uptime, @last_update)", &insert_stmt);
+    prepare_statement("BEGIN TRANSACTION", &begin_stmt);
+    prepare_statement("COMMIT TRANSACTION", &commit_stmt);
+    prepare_statement("SELECT * FROM uptime", &select_all_stmt);
 
-    log_info("SQLite database initialized");
+    uv_mutex_init(&db_lock);
+    uv_mutex_init(&pending_lock);
+    uv_cond_init(&commit_done);
+    uv_timer_init(uv_default_loop(), &write_behind_timer);
+    uv_async_init(uv_default_loop(), &write_behind_async, on_write_behind_async);
+    uv_unref((uv_handle_t*)&write_behind_async);
+
+    load_device_states();
+
+    log_info("SQLite database initialized. Loaded %d devices.", count_devices());
 }
 
-void insert_uptime_entry(uptime_entry_t* entry)
+void shutdown_database()
 {
-    sqlite3* db = NULL;
-    sqlite3_stmt* stmt = NULL;
-    
-    int open = sqlite3_open(SQLite_db_filepath, &db);
-    if (open != SQLITE_OK) {
-        log_synchronous(ERROR, "insert_uptime_entry: Failed to open the database at [%s]. "
-            "SQLite Error: %d", SQLite_db_filepath, open);
-        _exit(SIGTERM);
+    if (NULL == db)
+        return;
+
+    if (uv_is_active((uv_handle_t*)&write_behind_timer))
+        uv_timer_stop(&write_behind_timer);
+
+    flush_uptime_entries();
+
+    uv_mutex_lock(&db_lock);
+
+    sqlite3_finalize(insert_stmt);
+    sqlite3_finalize(begin_stmt);
+    sqlite3_finalize(commit_stmt);
+    sqlite3_finalize(select_all_stmt);
+    insert_stmt = begin_stmt = commit_stmt = select_all_stmt = NULL;
+
+    int close = sqlite3_close(db);
+    if (close != SQLITE_OK)
+        log_synchronous(ERROR, "shutdown_database: Failed to close the database. SQLite Error: %d", close);
+    db = NULL;
+
+    uv_mutex_unlock(&db_lock);
+    uv_mutex_destroy(&db_lock);
+    uv_mutex_destroy(&pending_lock);
+    uv_cond_destroy(&commit_done);
+
+    for (int i = 0; i < device_shard_count; i++) {
+        device_shard_t* shard = &device_shards[i];
+        uv_rwlock_wrlock(&shard->lock);
+        hash_table_foreach(shard->devices, free_device_state, NULL);
+        hash_table_free(shard->devices);
+        shard->devices = NULL;
+        timer_wheel_free(shard->outage_wheel);
+        shard->outage_wheel = NULL;
+        uv_rwlock_wrunlock(&shard->lock);
+        uv_rwlock_destroy(&shard->lock);
     }
 
-    sqlite3_busy_timeout(db, 100);  // Wait 100 ms for the lock
+    log_info("SQLite database closed");
+}
 
-    int begin_transaction = sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, NULL);
-    if(begin_transaction != SQLITE_OK) {
-        log_synchronous(ERROR, "insert_uptime_entry: Failed to begin transaction."
-            " SQLite Error: %d", begin_transaction);
-        _exit(SIGTERM);
-    }
+static int step_insert(uptime_entry_t* entry)
+{
+    sqlite3_bind_text (insert_stmt, 1, entry->mac_address, -1, SQLITE_STATIC);
+    sqlite3_bind_text (insert_stmt, 2, entry->description, -1, SQLITE_STATIC);
+    sqlite3_bind_int  (insert_stmt, 3, entry->uptime);
+    sqlite3_bind_int64(insert_stmt, 4, entry->last_update);
 
-    static const char* query = "INSERT INTO uptime VALUES (@mac_address, @description, @uptime, @last_update)";
-    
-    int insert = sqlite3_prepare_v2(db, query, 256, &stmt, NULL);
-    if(insert != SQLITE_OK) {
+    int insert = sqlite3_step(insert_stmt);
+    sqlite3_clear_bindings(insert_stmt);
+    sqlite3_reset(insert_stmt);
+
+    return insert;
+}
+
+static int step_once(sqlite3_stmt* stmt)
+{
+    int step = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    return step;
+}
+
+void insert_uptime_entry(uptime_entry_t* entry)
+{
+    if (NULL == entry)
+        return;
+
+    uint64_t started_at = metrics_now();
+
+    uv_mutex_lock(&db_lock);
+    int insert = step_insert(entry);
+    uv_mutex_unlock(&db_lock);
+
+    if (insert != SQLITE_DONE) {
         log_synchronous(ERROR, "insert_uptime_entry: Failed to insert into db. "
             "SQLite Error: %d", insert);
         _exit(SIGTERM);
     }
 
-    if (NULL != entry) {
-        sqlite3_bind_text (stmt, 1, entry->mac_address, -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text (stmt, 2, entry->description, -1, SQLITE_TRANSIENT);
-        sqlite3_bind_int  (stmt, 3, entry->uptime);
-        sqlite3_bind_int64(stmt, 4, entry->last_update);
+    metrics_count(METRIC_ENTRIES_COMMITTED, 1);
+    metrics_record_latency(STAGE_INSERT_UPTIME_ENTRY, started_at);
+}
+
+static void commit_uptime_entries(list* batch)
+{
+    uint64_t started_at = metrics_now();
+    uint64_t committed = 0;
+
+    uv_mutex_lock(&db_lock);
+
+    int begin_transaction = step_once(begin_stmt);
+    if (begin_transaction != SQLITE_DONE) {
+        log_synchronous(ERROR, "commit_uptime_entries: Failed to begin transaction."
+            " SQLite Error: %d", begin_transaction);
+        _exit(SIGTERM);
+    }
 
-        sqlite3_step(stmt);
-        sqlite3_clear_bindings(stmt);
-        sqlite3_reset(stmt);
+    for (element_t* node = batch->head; node != NULL; node = node->next) {
+        int insert = step_insert((uptime_entry_t*)node->data);
+        if (insert != SQLITE_DONE) {
+            log_synchronous(ERROR, "commit_uptime_entries: Failed to insert into db. "
+                "SQLite Error: %d", insert);
+            _exit(SIGTERM);
+        }
+        committed++;
     }
 
-    int end_transaction = sqlite3_exec(db, "END TRANSACTION", NULL, NULL, NULL);
-    if(end_transaction != SQLITE_OK) {
-        log_synchronous(ERROR, "insert_uptime_entry: Failed to end transaction."
+    int end_transaction = step_once(commit_stmt);
+    if (end_transaction != SQLITE_DONE) {
+        log_synchronous(ERROR, "commit_uptime_entries: Failed to end transaction."
             " SQLite Error: %d", end_transaction);
         _exit(SIGTERM);
     }
 
-    sqlite3_finalize(stmt);
-    sqlite3_close(db);
+    uv_mutex_unlock(&db_lock);
+
+    uint64_t committed_at = metrics_now();
+    for (element_t* node = batch->head; node != NULL; node = node->next)
+        metrics_record_interval(STAGE_COMMIT_WAIT, ((pending_entry_t*)node->data)->queued_at, committed_at);
+
+    metrics_count(METRIC_ENTRIES_COMMITTED, committed);
+    metrics_record_interval(STAGE_INSERT_UPTIME_ENTRY, started_at, committed_at);
 }
 
-uptime_record* get_uptime_record_with_modifiers(const char* sql_query_modifiers)
+static list* take_pending_entries()
 {
-    sqlite3* db;
-    sqlite3_stmt* stmt;
+    list* batch = pending_entries;
+    pending_entries = NULL;
+    pending_count = 0;
+    return batch;
+}
 
-    int open = sqlite3_open(SQLite_db_filepath, &db);
-    if (open != SQLITE_OK) {
-        log_synchronous(ERROR, "get_uptime_record: Failed to open the database at [%s]."
-            "  SQLite Error: %d", SQLite_db_filepath, open);
-        return NULL;
-    }
+static void on_commit_thread(uv_work_t* req)
+{
+    list* batch = (list*)req->data;
 
-    sqlite3_busy_timeout(db, 100);  // Wait 100 ms for the lock
+    commit_uptime_entries(batch);
+    free_uptime_record(batch);
 
-    int begin_transaction = sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, NULL);
-    if(begin_transaction != SQLITE_OK) {
-        log_synchronous(ERROR, "get_uptime_record: Failed to begin transaction. "
-            "SQLite Error: %d", begin_transaction);
-        return NULL;
+    uv_mutex_lock(&pending_lock);
+    commit_in_flight = false;
+    uv_cond_signal(&commit_done);
+    uv_mutex_unlock(&pending_lock);
+}
+
+static void schedule_commit()
+{
+    uv_mutex_lock(&pending_lock);
+    if (commit_in_flight || NULL == pending_entries) {
+        uv_mutex_unlock(&pending_lock);
+        return;
     }
+    list* batch = take_pending_entries();
+    commit_in_flight = true;
+    uv_mutex_unlock(&pending_lock);
 
-    const char* sql_query_base = "select * from uptime ";
+    if (uv_is_active((uv_handle_t*)&write_behind_timer))
+        uv_timer_stop(&write_behind_timer);
 
-    if (NULL == sql_query_modifiers)
-        sql_query_modifiers = "\0";
-    char* sql_query = (char*)malloc(sizeof(char)*(strlen(sql_query_modifiers)) + 22);
-    sprintf(sql_query, "%s %s", sql_query_base, sql_query_modifiers);
+    uv_work_t* req = (uv_work_t*)malloc(sizeof(uv_work_t));
+    req->data = batch;
+    uv_queue_work(uv_default_loop(), req, on_commit_thread, on_commit_thread_done);
+}
 
-    int record_query = sqlite3_prepare_v2(db, sql_query, 256, &stmt, NULL);
-    free(sql_query);
-    if (record_query != SQLITE_OK) {
-        log_synchronous(ERROR, "get_uptime_record: Failed to execute the select query [%s]."
-            "  SQLite Error: %d", sql_query, record_query);
-        return NULL;
-    }
+// Runs on the default loop.  Commits now if a full batch is waiting,
+// otherwise makes sure the oldest pending entry is committed in time.
+static void review_pending_entries()
+{
+    uv_mutex_lock(&pending_lock);
+    int count = pending_count;
+    uv_mutex_unlock(&pending_lock);
+
+    if (count >= write_behind_max_batch)
+        schedule_commit();
+    else if (count > 0 && !uv_is_active((uv_handle_t*)&write_behind_timer))
+        uv_timer_start(&write_behind_timer, on_write_behind_timer, write_behind_max_delay_ms, 0);
+}
 
-    uptime_record* retval = list_init();
+static void on_commit_thread_done(uv_work_t* req, int status)
+{
+    if (0 != status)
+        log_error("Failed to commit queued uptime entries from thread.  Error Code: %d", status);
 
-    while(sqlite3_step(stmt) == SQLITE_ROW) {
-        uptime_entry_t* record = (uptime_entry_t*)calloc(1, sizeof(uptime_entry_t));
+    free(req);
 
-        char* mac_address   = (char*)sqlite3_column_text(stmt, 0);
-        char* description   = (char*)sqlite3_column_text(stmt, 1);
-        uint32_t uptime     = sqlite3_column_int(stmt, 2);                    // unchecked
-        time_t last_update  = (time_t)sqlite3_column_int64(stmt, 3);
+    // Entries that arrived while the batch was in flight still owe a commit.
+    review_pending_entries();
+}
 
-        record->mac_address = strdup(mac_address);
-        record->description = strdup(description);    
-        record->uptime = uptime;
-        record->last_update = last_update;
+static void on_write_behind_timer(uv_timer_t* handle)
+{
+    schedule_commit();
+}
 
-        list_append(retval, record);
-    }
+static void on_write_behind_async(uv_async_t* handle)
+{
+    review_pending_entries();
+}
 
-    int end_transaction = sqlite3_exec(db, "END TRANSACTION", NULL, NULL, NULL);
-    if(end_transaction != SQLITE_OK) {
-        log_synchronous(ERROR, "get_uptime_record: Failed to end transaction. "
-            "SQLite Error: %d", end_transaction);
-        return NULL;
+void queue_uptime_entry(uptime_entry_t* entry)
+{
+    if (NULL == entry)
+        return;
+
+    update_device_state(entry);
+
+    pending_entry_t* pending = (pending_entry_t*)malloc(sizeof(pending_entry_t));
+    copy_uptime_entry_into(&pending->entry, entry);
+    pending->queued_at = metrics_now();
+
+    uv_mutex_lock(&pending_lock);
+    if (pending_count >= write_behind_max_pending) {
+        bool first_dropped = !dropping_entries;
+        dropping_entries = true;
+        uv_mutex_unlock(&pending_lock);
+
+        if (first_dropped)
+            log_warn("queue_uptime_entry: %d entries are waiting to be committed; dropping new ones until the database catches up.",
+                write_behind_max_pending);
+        metrics_count(METRIC_ENTRIES_DROPPED, 1);
+        free_uptime_entry_t(&pending->entry);
+        return;
     }
+    dropping_entries = false;
+    if (NULL == pending_entries)
+        pending_entries = list_init();
+    list_append(pending_entries, pending);
+    int count = ++pending_count;
+    uv_mutex_unlock(&pending_lock);
+
+    // The first entry of a batch needs the timer armed and a full batch
+    // needs committing; both happen on the default loop.
+    if (count == 1 || count == write_behind_max_batch)
+        uv_async_send(&write_behind_async);
+}
 
-    sqlite3_finalize(stmt);
-    sqlite3_close(db);
+void flush_uptime_entries()
+{
+    uv_mutex_lock(&pending_lock);
+    while (commit_in_flight)
+        uv_cond_wait(&commit_done, &pending_lock);
+    list* batch = take_pending_entries();
+    uv_mutex_unlock(&pending_lock);
 
-    return retval;
+    if (NULL == batch)
+        return;
+
+    commit_uptime_entries(batch);
+    free_uptime_record(batch);
+}
+
+static void append_copy(void* data, void* collection)
+{
+    list_append((list*)collection, copy_uptime_entry_t(&((device_state_t*)data)->entry));
 }
 
 uptime_record* get_uptime_record()
 {
-    return get_uptime_record_with_modifiers(NULL);
+    uptime_record* retval = list_init();
+
+    for (int i = 0; i < device_shard_count; i++) {
+        uv_rwlock_rdlock(&device_shards[i].lock);
+        hash_table_foreach(device_shards[i].devices, append_copy, retval);
+        uv_rwlock_rdunlock(&device_shards[i].lock);
+    }
+
+    return retval;
 }
 
 uint32_t get_last_known_uptime(const char* mac_address)
@@ -181,23 +568,72 @@ uint32_t get_last_known_uptime(const char* mac_address)
     if (NULL == mac_address)
         return 0;
 
-    const char* where_clause_base = "WHERE mac_address='%s'";
-    char* where_clause = (char*)malloc(sizeof(char)*(strlen(mac_address)) + 21);
-    sprintf(where_clause, where_clause_base, mac_address);
+    uint32_t retval = 0;
 
-    uptime_record* record = get_uptime_record_with_modifiers(where_clause);
+    device_shard_t* shard = shard_for(mac_address);
 
-    if (NULL == record->head)
-    	return 0;
+    uv_rwlock_rdlock(&shard->lock);
+    device_state_t* state = (device_state_t*)hash_table_get(shard->devices, mac_address);
+    if (NULL != state)
+        retval = state->entry.uptime;
+    uv_rwlock_rdunlock(&shard->lock);
 
-    uint32_t retval = ((uptime_entry_t*)(record->head->data))->uptime;
-    free_uptime_record(record);
     return retval;
 }
 
+typedef struct device_callback_t {
+    void (*fptr)(const uint8_t*, size_t, void*);
+    void* args;
+} device_callback_t;
+
+static void on_device_state(void* data, void* args)
+{
+    device_callback_t* callback = (device_callback_t*)args;
+    device_state_t* state = (device_state_t*)data;
+    (*callback->fptr)(state->serialized, state->serialized_len, callback->args);
+}
+
+void device_state_foreach_serialized(void (*fptr)(const uint8_t*, size_t, void*), void* args)
+{
+    device_callback_t callback = { fptr, args };
+
+    for (int i = 0; i < device_shard_count; i++) {
+        uv_rwlock_rdlock(&device_shards[i].lock);
+        hash_table_foreach(device_shards[i].devices, on_device_state, &callback);
+        uv_rwlock_rdunlock(&device_shards[i].lock);
+    }
+}
+
+uint64_t get_device_state_generation()
+{
+    return __atomic_load_n(&devices_generation, __ATOMIC_ACQUIRE);
+}
+
+static void collect_expired_device(timer_wheel_node_t* node, void* expired)
+{
+    device_state_t* state = (device_state_t*)node->data;
+    list_append((list*)expired, copy_uptime_entry_t(&state->entry));
+}
+
+// The shard is only locked while its wheel advances; fptr runs on copies
+// afterwards, so it can log and broadcast without stalling the shard.
+void check_for_outages(time_t current_time, void (*fptr)(uptime_entry_t*, void*), void* args)
+{
+    uptime_record* expired = list_init();
+
+    for (int i = 0; i < device_shard_count; i++) {
+        uv_rwlock_wrlock(&device_shards[i].lock);
+        timer_wheel_advance(device_shards[i].outage_wheel, current_time, collect_expired_device, expired);
+        uv_rwlock_wrunlock(&device_shards[i].lock);
+    }
+
+    uptime_record_foreach(expired, fptr, args);
+    free_uptime_record(expired);
+}
+
 void uptime_record_foreach(uptime_record* collection, void (*fptr)(uptime_entry_t*, void*), void* args)
 {
-    list_foreach(collection, (void(*)(void*, void*))&fptr, args);
+    list_foreach(collection, (void(*)(void*, void*))fptr, args);
 }
 
 void free_uptime_entry_t(uptime_entry_t* entry)
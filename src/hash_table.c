@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "hash_table.h"
+
+static const size_t initial_bucket_count = 64;
+
+// FNV-1a
+size_t hash_string(const char* key)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char* c = (const unsigned char*)key; *c != '\0'; c++) {
+        hash ^= *c;
+        hash *= 1099511628211ULL;
+    }
+    return (size_t)hash;
+}
+
+static hash_entry_t** find_slot(struct hash_table* table, const char* key)
+{
+    hash_entry_t** slot = &table->buckets[hash_string(key) & (table->bucket_count - 1)];
+    while (*slot != NULL && strcmp((*slot)->key, key) != 0)
+        slot = &(*slot)->next;
+    return slot;
+}
+
+static void grow(struct hash_table* table)
+{
+    size_t new_count = table->bucket_count * 2;
+    hash_entry_t** new_buckets = (hash_entry_t**)calloc(new_count, sizeof(hash_entry_t*));
+
+    for (size_t i = 0; i < table->bucket_count; i++) {
+        hash_entry_t* current = table->buckets[i];
+        while (current != NULL) {
+            hash_entry_t* next = current->next;
+            size_t index = hash_string(current->key) & (new_count - 1);
+            current->next = new_buckets[index];
+            new_buckets[index] = current;
+            current = next;
+        }
+    }
+
+    free(table->buckets);
+    table->buckets = new_buckets;
+    table->bucket_count = new_count;
+}
+
+struct hash_table* hash_table_init()
+{
+    struct hash_table* table = (struct hash_table*)calloc(1, sizeof(struct hash_table));
+    table->bucket_count = initial_bucket_count;
+    table->buckets = (hash_entry_t**)calloc(table->bucket_count, sizeof(hash_entry_t*));
+    return table;
+}
+
+// Caller responsible for freeing keys and data.
+void hash_table_free(struct hash_table* table)
+{
+    if (NULL == table)
+        return;
+
+    for (size_t i = 0; i < table->bucket_count; i++) {
+        hash_entry_t* current = table->buckets[i];
+        while (current != NULL) {
+            hash_entry_t* to_free = current;
+            current = current->next;
+            free(to_free);
+        }
+    }
+
+    free(table->buckets);
+    free(table);
+}
+
+void* hash_table_put(struct hash_table* table, const char* key, void* data)
+{
+    if (NULL == table || NULL == key)
+        return NULL;
+
+    hash_entry_t** slot = find_slot(table, key);
+    if (*slot != NULL) {
+        void* replaced = (*slot)->data;
+        (*slot)->key = key;
+        (*slot)->data = data;
+        return replaced;
+    }
+
+    hash_entry_t* to_insert = (hash_entry_t*)malloc(sizeof(hash_entry_t));
+    to_insert->key = key;
+    to_insert->data = data;
+    to_insert->next = NULL;
+    *slot = to_insert;
+
+    if (++table->count > table->bucket_count)
+        grow(table);
+
+    return NULL;
+}
+
+void* hash_table_get(struct hash_table* table, const char* key)
+{
+    if (NULL == table || NULL == key)
+        return NULL;
+
+    hash_entry_t* entry = *find_slot(table, key);
+    return (entry != NULL) ? entry->data : NULL;
+}
+
+void* hash_table_remove(struct hash_table* table, const char* key)
+{
+    if (NULL == table || NULL == key)
+        return NULL;
+
+    hash_entry_t** slot = find_slot(table, key);
+    hash_entry_t* entry = *slot;
+    if (NULL == entry)
+        return NULL;
+
+    void* data = entry->data;
+    *slot = entry->next;
+    free(entry);
+    table->count--;
+
+    return data;
+}
+
+void hash_table_foreach(struct hash_table* table, void (*fptr)(void*, void*), void* args)
+{
+    if (NULL == table)
+        return;
+
+    for (size_t i = 0; i < table->bucket_count; i++) {
+        for (hash_entry_t* node = table->buckets[i]; node != NULL; node = node->next)
+            (*fptr)(node->data, args);
+    }
+}
+
+void hash_table_stats(struct hash_table* table, size_t* used_buckets, size_t* longest_chain)
+{
+    *used_buckets = 0;
+    *longest_chain = 0;
+
+    for (size_t i = 0; i < table->bucket_count; i++) {
+        size_t chain = 0;
+        for (hash_entry_t* node = table->buckets[i]; node != NULL; node = node->next)
+            chain++;
+
+        if (chain > 0)
+            (*used_buckets)++;
+        if (chain > *longest_chain)
+            *longest_chain = chain;
+    }
+}
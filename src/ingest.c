@@ -0,0 +1,608 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "uv.h"
+#include "logger.h"
+#include "serialization.h"
+#include "buffer_pool.h"
+#include "arena.h"
+#include "metrics.h"
+#include "ingest.h"
+
+// Where a report is handled.  Each report is decoded into the arena, which
+// is reset as soon as the report handler returns.
+typedef struct report_context_t {
+    uv_loop_t* loop;
+    struct arena* arena;
+} report_context_t;
+
+static const size_t report_arena_block_size = 8192;
+
+// Every ingest loop has its own listener, report context and pool of read
+// buffers.  With more than one ingest thread, each runs its own loop with
+// its own SO_REUSEPORT listener on the ingest port and the kernel spreads
+// new connections across them.  Everything downstream of report_handler
+// must therefore be thread-safe.
+typedef struct ingest_worker_t {
+    uv_loop_t* loop;
+    report_context_t reports;
+    uv_tcp_t server;
+    struct buffer_pool* read_buffers;
+    struct connection_t* free_connections;
+    size_t free_connection_count;
+    uv_thread_t thread;
+    uv_async_t stop_async;  // Asks the worker's loop to wind down
+    uv_loop_t own_loop;     // Unused when ingest runs on the default loop
+} ingest_worker_t;
+
+static ingest_worker_t* workers = NULL;
+static int worker_count = 0;
+
+// Reports are well under a page, so one page per read holds many of them.
+// Buffers go back to the pool as soon as the read has been handled, so a
+// loop rarely has more than one out at a time.
+static const size_t read_buffer_size = 4096;
+static const size_t read_buffer_pool_max_free = 16;
+
+// Closed connections go back on their loop's free list, reassembly buffer
+// and all, to be reused by the next accept.
+static const size_t connection_pool_max_free = 1024;
+
+// Per-connection state.  The handle must stay the first member so that
+// callbacks can get from the handle back to the connection.
+typedef struct connection_t {
+    uv_tcp_t handle;
+    uv_timer_t idle_timer;
+    ingest_worker_t* worker;
+    struct connection_t* next_free;
+    int open_handles;       // Returned to the pool once both handles have closed
+    uint64_t connected_at;
+    uint64_t last_activity; // Loop time of the last read
+    uint64_t reports;
+    uint64_t bytes;
+    uint8_t* pending;       // Bytes of a report that has not fully arrived yet
+    size_t pending_len;
+    size_t pending_capacity;
+    uint64_t pending_since; // metrics_now() when the pending report started arriving
+} connection_t;
+
+// Shared by all ingest loops.
+static int active_connections = 0;
+static uint64_t rejected_connections = 0;
+static uint64_t timed_out_connections = 0;
+static bool at_connection_limit = false;
+
+// Datagrams are drained in batches of up to datagram_batch_size per
+// system call.  Anything larger than a slot is truncated and dropped.
+#define datagram_batch_size 64
+#define datagram_slot_size 2048
+static const int datagram_receive_buffer_size = 4 * 1024 * 1024;    // Absorbs bursts between polls
+
+typedef struct datagram_listener_t {
+    uv_poll_t poll;
+    int fd;
+    report_context_t reports;
+    uint8_t buffers[datagram_batch_size][datagram_slot_size];
+#ifdef LINUX
+    struct mmsghdr headers[datagram_batch_size];
+    struct iovec iovecs[datagram_batch_size];
+#endif
+} datagram_listener_t;
+
+static void (*report_handler)(uptime_report_t*, uv_loop_t*) = NULL;
+
+static void alloc_buffer(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) 
+{
+    struct buffer_pool* pool = ((connection_t*)handle)->worker->read_buffers;
+    *buf = uv_buf_init((char*)buffer_pool_get(pool), pool->buffer_size);
+}
+
+static connection_t* acquire_connection(ingest_worker_t* worker)
+{
+    connection_t* conn = worker->free_connections;
+
+    if (NULL == conn) {
+        conn = (connection_t*)calloc(1, sizeof(connection_t));
+    } else {
+        worker->free_connections = conn->next_free;
+        worker->free_connection_count--;
+    }
+
+    conn->worker = worker;
+    conn->next_free = NULL;
+    conn->reports = 0;
+    conn->bytes = 0;
+    conn->pending_len = 0;
+
+    __atomic_add_fetch(&active_connections, 1, __ATOMIC_RELAXED);
+    return conn;
+}
+
+static void release_connection(connection_t* conn)
+{
+    ingest_worker_t* worker = conn->worker;
+
+    __atomic_sub_fetch(&active_connections, 1, __ATOMIC_RELAXED);
+
+    if (worker->free_connection_count >= connection_pool_max_free) {
+        free(conn->pending);
+        free(conn);
+        return;
+    }
+
+    conn->next_free = worker->free_connections;
+    worker->free_connections = conn;
+    worker->free_connection_count++;
+}
+
+static void on_close (uv_handle_t* handle) 
+{ 
+    connection_t* conn = (connection_t*)handle->data;
+    if (--conn->open_handles == 0)
+        release_connection(conn);
+}
+
+static void close_connection(connection_t* conn)
+{
+    if (!uv_is_closing((uv_handle_t*)&conn->handle)) {
+        uv_close((uv_handle_t*)&conn->handle, on_close);
+        uv_close((uv_handle_t*)&conn->idle_timer, on_close);
+    }
+}
+
+// Reads only stamp last_activity; the timer is not touched until it fires,
+// at which point it either closes the connection or sleeps for whatever is
+// left of the timeout.
+static void on_idle_timer(uv_timer_t* timer)
+{
+    connection_t* conn = (connection_t*)timer->data;
+    uint64_t idle_ms = uv_now(timer->loop) - conn->last_activity;
+
+    if (idle_ms < connection_idle_timeout_ms) {
+        uv_timer_start(timer, on_idle_timer, connection_idle_timeout_ms - idle_ms, 0);
+        return;
+    }
+
+    __atomic_add_fetch(&timed_out_connections, 1, __ATOMIC_RELAXED);
+    log_info("Closing connection idle for %d s, after %llu reports over %d s.",
+        (int)(idle_ms / 1000), (unsigned long long)conn->reports,
+        (int)((uv_now(timer->loop) - conn->connected_at) / 1000));
+    close_connection(conn);
+}
+
+static void handle_report(const uint8_t* buf, size_t len, report_context_t* context)
+{
+    uint64_t started_at = metrics_now();
+    uptime_report_t* uptime_data = deserialize_report((const char*)buf, len, context->arena);
+    metrics_record_latency(STAGE_DESERIALIZE_REPORT, started_at);
+
+    if (uptime_data != NULL) {
+        metrics_count(METRIC_REPORTS_DECODED, 1);
+        report_handler(uptime_data, context->loop);
+    } else {
+        metrics_count(METRIC_DECODE_FAILURES, 1);
+    }
+    arena_reset(context->arena);
+}
+
+// Handles every complete report at the front of buf, adding them to
+// *handled.  Returns the number of bytes consumed, or -1 if the stream is
+// malformed.
+static ssize_t consume_reports(const uint8_t* buf, size_t len, report_context_t* context, uint64_t* handled)
+{
+    size_t offset = 0;
+
+    while (offset < len) {
+        uint64_t report_len = 0;
+        int prefix_len = decode_varint(buf + offset, len - offset, &report_len);
+        if (prefix_len < 0 || report_len > max_report_len)
+            return -1;
+        if (prefix_len == 0 || report_len > len - offset - prefix_len)
+            break;
+
+        handle_report(buf + offset + prefix_len, report_len, context);
+        offset += prefix_len + report_len;
+        (*handled)++;
+    }
+
+    return offset;
+}
+
+static void keep_pending(connection_t* conn, const uint8_t* buf, size_t len, uint64_t arrived_at)
+{
+    if (0 == len)
+        return;
+    if (0 == conn->pending_len)
+        conn->pending_since = arrived_at;
+
+    if (conn->pending_len + len > conn->pending_capacity) {
+        conn->pending_capacity = conn->pending_len + len;
+        conn->pending = (uint8_t*)realloc(conn->pending, conn->pending_capacity);
+    }
+    memcpy(conn->pending + conn->pending_len, buf, len);
+    conn->pending_len += len;
+}
+
+static bool process_read(connection_t* conn, const uint8_t* buf, size_t len, uint64_t arrived_at)
+{
+    // Common case: nothing left over from the last read, so reports are
+    // handled straight out of the read buffer and only a trailing partial
+    // report is copied.
+    report_context_t* context = &conn->worker->reports;
+
+    if (conn->pending_len == 0) {
+        ssize_t consumed = consume_reports(buf, len, context, &conn->reports);
+        if (consumed < 0)
+            return false;
+        keep_pending(conn, buf + consumed, len - consumed, arrived_at);
+        return true;
+    }
+
+    keep_pending(conn, buf, len, arrived_at);
+
+    ssize_t consumed = consume_reports(conn->pending, conn->pending_len, context, &conn->reports);
+    if (consumed < 0)
+        return false;
+
+    // The first report handled is the one that was split across reads; any
+    // partial report left over started arriving with this read.
+    if (consumed > 0) {
+        metrics_record_interval(STAGE_ASSEMBLE_REPORT, conn->pending_since, arrived_at);
+        conn->pending_since = arrived_at;
+    }
+
+    conn->pending_len -= consumed;
+    memmove(conn->pending, conn->pending + consumed, conn->pending_len);
+    return true;
+}
+
+static void on_read(uv_stream_t* client, ssize_t nread, const uv_buf_t* buf)
+{
+    connection_t* conn = (connection_t*)client;
+
+    if (0 == nread)
+        goto cleanup;
+
+    if (UV_EOF == nread) {
+        if (conn->pending_len > 0)
+            log_warn("Connection closed partway through a report. Dropped %d bytes.", (int)conn->pending_len);
+        close_connection(conn);
+        goto cleanup;
+    }
+
+    if (nread < 0) {
+        close_connection(conn);
+        const char* err = uv_err_name(nread);    // (per the docs) leaks a few bytes of memory for unknown err code
+        const char* msg = uv_strerror(nread);    // ^^^
+        log_error("Error reading message from new connection: LibUV err [%s], LibUv msg [{%s}].", err, msg);
+        goto cleanup;
+    } 
+
+    conn->last_activity = uv_now(client->loop);
+    conn->bytes += nread;
+    metrics_count(METRIC_READS, 1);
+    metrics_count(METRIC_BYTES_READ, nread);
+
+    uint64_t started_at = metrics_now();
+    bool processed = process_read(conn, (const uint8_t*)buf->base, nread, started_at);
+    metrics_record_latency(STAGE_READ, started_at);
+
+    if (!processed) {
+        log_error("Malformed report stream received. Closing connection.");
+        close_connection(conn);
+    }
+
+    cleanup:
+    buffer_pool_put(conn->worker->read_buffers, buf->base);
+}
+
+static void on_new_connection(uv_stream_t *server, int status) 
+{
+    if (status < 0) {
+        log_error("on_new_connection -- New connection error %s\n", uv_strerror(status));
+        return;
+    }
+
+    uint64_t started_at = metrics_now();
+    connection_t* conn = acquire_connection((ingest_worker_t*)server->data);
+    uv_tcp_init(server->loop, &conn->handle);
+    uv_timer_init(server->loop, &conn->idle_timer);
+    conn->handle.data = conn;
+    conn->idle_timer.data = conn;
+    conn->open_handles = 2;
+
+    // Over the limit the connection is still accepted, since leaving it in
+    // the backlog would stall the listener, but it is closed straight away.
+    if (uv_accept(server, (uv_stream_t*)&conn->handle) != 0) {
+        close_connection(conn);
+        return;
+    }
+
+    if (__atomic_load_n(&active_connections, __ATOMIC_RELAXED) > max_connections) {
+        __atomic_add_fetch(&rejected_connections, 1, __ATOMIC_RELAXED);
+        metrics_count(METRIC_CONNECTIONS_REFUSED, 1);
+        if (!__atomic_exchange_n(&at_connection_limit, true, __ATOMIC_RELAXED))
+            log_warn("Reached %d connections. Refusing new ones until some close.", max_connections);
+        close_connection(conn);
+        return;
+    }
+
+    __atomic_store_n(&at_connection_limit, false, __ATOMIC_RELAXED);
+
+    conn->connected_at = uv_now(server->loop);
+    conn->last_activity = conn->connected_at;
+    uv_timer_start(&conn->idle_timer, on_idle_timer, connection_idle_timeout_ms, 0);
+    uv_read_start((uv_stream_t*)&conn->handle, alloc_buffer, on_read);
+
+    metrics_count(METRIC_CONNECTIONS_ACCEPTED, 1);
+    metrics_record_latency(STAGE_ACCEPT, started_at);
+}
+
+static void handle_datagram(datagram_listener_t* listener, const uint8_t* buf, size_t len, bool truncated)
+{
+    metrics_count(METRIC_DATAGRAMS_RECEIVED, 1);
+
+    if (truncated) {
+        metrics_count(METRIC_DATAGRAMS_DROPPED, 1);
+        log_warn("Dropped a datagram larger than %d bytes.", datagram_slot_size);
+        return;
+    }
+
+    // A datagram has to hold whole reports; there is nothing to reassemble with.
+    uint64_t handled = 0;
+    if (consume_reports(buf, len, &listener->reports, &handled) != (ssize_t)len) {
+        metrics_count(METRIC_DATAGRAMS_DROPPED, 1);
+        log_error("Malformed report datagram received. Dropped it.");
+    }
+}
+
+#ifdef LINUX
+
+static int receive_datagrams(datagram_listener_t* listener)
+{
+    for (int i = 0; i < datagram_batch_size; i++) {
+        listener->headers[i].msg_hdr.msg_flags = 0;
+        listener->headers[i].msg_len = 0;
+    }
+
+    int received = recvmmsg(listener->fd, listener->headers, datagram_batch_size, MSG_DONTWAIT, NULL);
+
+    for (int i = 0; i < received; i++) {
+        handle_datagram(listener, listener->buffers[i], listener->headers[i].msg_len,
+            (listener->headers[i].msg_hdr.msg_flags & MSG_TRUNC) != 0);
+    }
+
+    return received;
+}
+
+#else
+
+static int receive_datagrams(datagram_listener_t* listener)
+{
+    int received = 0;
+
+    while (received < datagram_batch_size) {
+        ssize_t len = recv(listener->fd, listener->buffers[received], datagram_slot_size, MSG_DONTWAIT | MSG_TRUNC);
+        if (len < 0)
+            break;
+        handle_datagram(listener, listener->buffers[received], (len > datagram_slot_size) ? datagram_slot_size : len, len > datagram_slot_size);
+        received++;
+    }
+
+    return (received > 0) ? received : -1;
+}
+
+#endif
+
+static void on_datagrams_readable(uv_poll_t* handle, int status, int events)
+{
+    datagram_listener_t* listener = (datagram_listener_t*)handle->data;
+
+    if (status < 0) {
+        log_error("Error polling the report datagram socket: %s.", uv_strerror(status));
+        return;
+    }
+
+    // Drain whatever is queued, a batch at a time.  A short batch means the
+    // socket is empty.
+    int received;
+    do {
+        received = receive_datagrams(listener);
+    } while (received == datagram_batch_size);
+
+    if (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        log_error("Error receiving report datagrams: %s.", strerror(errno));
+}
+
+bool listen_for_datagrams(const char* ip_addr, int port, void (*on_report)(uptime_report_t*, uv_loop_t*))
+{
+    static datagram_listener_t listener;
+
+    report_handler = on_report;
+
+    struct sockaddr_in addr;
+    uv_ip4_addr(ip_addr, port, &addr);
+
+    listener.fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (listener.fd < 0 || bind(listener.fd, (const struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        log_error("listen_for_datagrams -- failed to bind udp port %d: %s.", port, strerror(errno));
+        if (listener.fd >= 0)
+            close(listener.fd);
+        return false;
+    }
+
+    setsockopt(listener.fd, SOL_SOCKET, SO_RCVBUF, &datagram_receive_buffer_size, sizeof(datagram_receive_buffer_size));
+
+#ifdef LINUX
+    for (int i = 0; i < datagram_batch_size; i++) {
+        listener.iovecs[i].iov_base = listener.buffers[i];
+        listener.iovecs[i].iov_len = datagram_slot_size;
+        memset(&listener.headers[i], 0, sizeof(struct mmsghdr));
+        listener.headers[i].msg_hdr.msg_iov = &listener.iovecs[i];
+        listener.headers[i].msg_hdr.msg_iovlen = 1;
+    }
+#endif
+
+    listener.reports.loop = uv_default_loop();
+    listener.reports.arena = arena_init(report_arena_block_size);
+
+    uv_poll_init(uv_default_loop(), &listener.poll, listener.fd);
+    listener.poll.data = &listener;
+    uv_poll_start(&listener.poll, UV_READABLE, on_datagrams_readable);
+
+    return true;
+}
+
+static int bind_reuseport_socket(const struct sockaddr_in* addr)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0 ||
+        bind(fd, (const struct sockaddr*)addr, sizeof(*addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static bool start_listening(ingest_worker_t* worker)
+{
+    worker->read_buffers = buffer_pool_init(read_buffer_size, read_buffer_pool_max_free);
+    worker->reports.loop = worker->loop;
+    worker->reports.arena = arena_init(report_arena_block_size);
+    worker->server.data = worker;
+
+    int listen_resp = uv_listen((uv_stream_t*)&worker->server, 500, on_new_connection);
+    if (listen_resp != 0) {
+        log_error("listen_for_reports -- listen error: %s, %s.",
+            uv_err_name(listen_resp),  uv_strerror(listen_resp));
+        return false;
+    }
+    return true;
+}
+
+static void close_handle(uv_handle_t* handle, void* arg)
+{
+    if (!uv_is_closing(handle))
+        uv_close(handle, NULL);
+}
+
+// Closing every handle, listener and connections included, lets uv_run
+// return once any reboot work still queued from this loop has finished.
+static void on_stop_async(uv_async_t* handle)
+{
+    uv_walk(handle->loop, close_handle, NULL);
+}
+
+static void run_worker(void* arg)
+{
+    ingest_worker_t* worker = (ingest_worker_t*)arg;
+
+    // Termination signals go to the main thread, which joins this one.
+    sigset_t signals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    uv_run(worker->loop, UV_RUN_DEFAULT);
+    uv_loop_close(worker->loop);
+}
+
+static bool start_worker(ingest_worker_t* worker, const struct sockaddr_in* addr)
+{
+    int fd = bind_reuseport_socket(addr);
+    if (fd < 0) {
+        log_error("listen_for_reports -- failed to bind ingest port with SO_REUSEPORT: %s.", strerror(errno));
+        return false;
+    }
+
+    worker->loop = &worker->own_loop;
+    uv_loop_init(worker->loop);
+    uv_tcp_init(worker->loop, &worker->server);
+    uv_tcp_open(&worker->server, fd);
+    uv_async_init(worker->loop, &worker->stop_async, on_stop_async);
+
+    // shutdown_ingest only waits on workers that still have a loop.
+    if (!start_listening(worker) || uv_thread_create(&worker->thread, run_worker, worker) != 0) {
+        worker->loop = NULL;
+        return false;
+    }
+    return true;
+}
+
+bool listen_for_reports(const char* ip_addr, int port, int thread_count, void (*on_report)(uptime_report_t*, uv_loop_t*))
+{
+    report_handler = on_report;
+
+    struct sockaddr_in addr;
+    uv_ip4_addr(ip_addr, port, &addr);
+
+    worker_count = (thread_count <= 1) ? 1 : thread_count;
+    workers = (ingest_worker_t*)calloc(worker_count, sizeof(ingest_worker_t));
+
+    if (thread_count <= 1) {
+        workers[0].loop = uv_default_loop();
+        uv_tcp_init(workers[0].loop, &workers[0].server);
+        uv_tcp_bind(&workers[0].server, (const struct sockaddr*)&addr, 0);
+        return start_listening(&workers[0]);
+    }
+
+    for (int i = 0; i < thread_count; i++) {
+        if (!start_worker(&workers[i], &addr))
+            return false;
+    }
+
+    log_info("Ingest running on %d threads.", thread_count);
+    return true;
+}
+
+void shutdown_ingest()
+{
+    // A single ingest loop is the default loop, which stops with the process.
+    if (worker_count <= 1)
+        return;
+
+    for (int i = 0; i < worker_count; i++) {
+        if (workers[i].loop != NULL)
+            uv_async_send(&workers[i].stop_async);
+    }
+
+    for (int i = 0; i < worker_count; i++) {
+        if (workers[i].loop != NULL)
+            uv_thread_join(&workers[i].thread);
+    }
+
+    log_info("Ingest threads stopped.");
+}
+
+void get_read_buffer_stats(uint64_t* hits, uint64_t* misses)
+{
+    *hits = 0;
+    *misses = 0;
+
+    for (int i = 0; i < worker_count; i++) {
+        if (NULL == workers[i].read_buffers)
+            continue;
+
+        uint64_t worker_hits, worker_misses;
+        buffer_pool_stats(workers[i].read_buffers, &worker_hits, &worker_misses);
+        *hits += worker_hits;
+        *misses += worker_misses;
+    }
+}
+
+void get_connection_stats(int* active, uint64_t* rejected, uint64_t* timed_out)
+{
+    *active = __atomic_load_n(&active_connections, __ATOMIC_RELAXED);
+    *rejected = __atomic_load_n(&rejected_connections, __ATOMIC_RELAXED);
+    *timed_out = __atomic_load_n(&timed_out_connections, __ATOMIC_RELAXED);
+}
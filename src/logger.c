@@ -1,22 +1,139 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
 #include "uv.h"
 #include "zlog.h"
 #include "logger.h"
-#include "list.h"
 
-typedef struct log_data_t {
+#define log_ring_capacity 4096      // Must be a power of two
+#define log_record_max_len 512      // Longer messages are truncated
+#define log_formatted_max_len 2048  // Limit for a deferred message once formatted
+
+#define log_batch_max_len (64 * 1024)
+static const uint64_t log_writer_idle_wait_ns = 1000 * 1000 * 1000;
+
+typedef struct log_record_t {
+    uint64_t sequence;
     log_type type;
-    char* msg;
-} log_data_t;
+    time_t logged_at;
+    const char* format;             // Set if msg holds packed arguments for it
+    char msg[log_record_max_len];   // Otherwise the formatted message
+} log_record_t;
+
+// Deferred formatting: rather than format on the calling thread, the
+// argument values are copied into the record as raw bytes (strings
+// included) and the writer formats them, walking the same format string
+// to know what was stored.  Formats using anything not listed here are
+// formatted on the spot instead.
+typedef enum {
+    ARG_NONE,           // %%
+    ARG_INT,
+    ARG_LONG,
+    ARG_LLONG,
+    ARG_SIZE,
+    ARG_INTMAX,
+    ARG_PTRDIFF,
+    ARG_DOUBLE,
+    ARG_LDOUBLE,
+    ARG_POINTER,
+    ARG_STRING,
+    ARG_UNSUPPORTED
+} arg_kind;
+
+typedef union arg_value_t {
+    int i;
+    long l;
+    long long ll;
+    size_t z;
+    intmax_t j;
+    ptrdiff_t t;
+    double d;
+    long double ld;
+    void* p;
+} arg_value_t;
+
+typedef struct conversion_t {
+    arg_kind kind;
+    int star_count;         // Width and precision passed as int arguments
+    const char* start;      // The '%'
+    const char* end;        // One past the conversion character
+} conversion_t;
+
+static const int max_conversion_len = 32;
+
+// Bounded multi-producer, single-consumer ring of formatted log records.
+// A slot whose sequence equals a producer's claimed position is free to
+// fill; it is published by setting the sequence to position + 1, and the
+// consumer hands it back by setting it to position + log_ring_capacity.
+// Consumers are serialized by drain_lock, which producers never take
+// unless the ring is full and log_overflow is LOG_OVERFLOW_BLOCK.
+static log_record_t log_ring[log_ring_capacity];
+static uint64_t ring_head = 0;          // Next position for producers to claim
+static uint64_t ring_tail = 0;          // Next position to drain
+static uv_mutex_t drain_lock;
+static uint64_t dropped_logs = 0;
+static uint64_t reported_dropped_logs = 0;
+
+// One long-lived thread writes the ring out.  It sleeps on writer_wake
+// when there is nothing to write, and producers only signal it when it
+// has said it is sleeping.
+static uv_thread_t writer_thread;
+static uv_mutex_t writer_lock;
+static uv_cond_t writer_wake;
+static bool writer_sleeping = false;
+static bool writer_stopping = false;
+
+// Records are written out in batches, one zlog call and one console write
+// per batch.  A batch only holds lines of one level, so zlog rules can
+// still route by level.  The batch and the timestamp cache are only
+// touched with drain_lock held.
+static char batch[log_batch_max_len + 1];
+static size_t batch_len = 0;
+static log_type batch_type = INFO;
+static time_t cached_second = 0;
+static char cached_timestamp[32];
+
+// Duplicate suppression.  A message identical to the one before it is
+// only counted, and "Last message repeated N times" is written once a
+// different message comes along or the repeats are log_repeat_flush_sec
+// old.  Only touched with drain_lock held.
+static char last_msg[log_formatted_max_len];
+static size_t last_msg_len = 0;
+static log_type last_msg_type = DEBUG;
+static const log_type no_last_msg = (log_type)-1;   // Matches no message
+static uint64_t last_msg_repeats = 0;
+static time_t last_msg_repeats_since = 0;
+static uint64_t repeated_logs = 0;
+static const time_t log_repeat_flush_sec = 1;
+
+// Per-call-site rate limiting, keyed by format string pointer.  Each site
+// has a token bucket packed into one word so it can be updated with a
+// single compare-and-swap: the refill time in milliseconds in the top 40
+// bits, the tokens in thousandths in the bottom 24.  A zeroed bucket reads
+// as having last refilled long ago, so it starts out full.
+#define log_site_table_size 1024    // Must be a power of two; sites past this are not limited
+static const int token_scale = 1000;
+static const int token_bits = 24;
+
+typedef struct log_site_t {
+    const char* format;
+    uint64_t bucket;
+    uint64_t suppressed;    // Since the site last got a message through
+} log_site_t;
+
+static log_site_t log_sites[log_site_table_size];
+static uint64_t rate_limited_logs = 0;
 
-static list* queued_logs;
-static bool flush_ongoing = false;
 static bool logger_initialized = false;
-static uv_rwlock_t queued_logs_lock;
 static zlog_category_t* zlog_category;
 
+static const char* log_type_names[] = {"DEBUG", "INFO", "WARNING", "ERROR", "FATAL"};
+
 static void set_zlog_error_file()
 {
     if(NULL == getenv("ZLOG_PROFILE_ERROR"))
@@ -42,115 +159,635 @@ static char* generate_str_from_args(const char* msg, va_list args)
     return full_message;
 }
 
-static void log_single_entry_synchronous(void* single_entry, void* category)
+typedef enum {LENGTH_NONE, LENGTH_HH, LENGTH_H, LENGTH_L, LENGTH_LL, LENGTH_Z, LENGTH_J, LENGTH_T, LENGTH_BIG_L} length_modifier;
+
+static const char* skip_digits(const char* p)
+{
+    while (isdigit((unsigned char)*p))
+        p++;
+    return p;
+}
+
+static const char* parse_length(const char* p, length_modifier* length)
+{
+    switch (*p) {
+        case 'h': 
+            *length = (p[1] == 'h') ? LENGTH_HH : LENGTH_H;
+            return p + ((p[1] == 'h') ? 2 : 1);
+        case 'l':
+            *length = (p[1] == 'l') ? LENGTH_LL : LENGTH_L;
+            return p + ((p[1] == 'l') ? 2 : 1);
+        case 'z': *length = LENGTH_Z; return p + 1;
+        case 'j': *length = LENGTH_J; return p + 1;
+        case 't': *length = LENGTH_T; return p + 1;
+        case 'L': *length = LENGTH_BIG_L; return p + 1;
+        default: *length = LENGTH_NONE; return p;
+    }
+}
+
+static arg_kind integer_kind(length_modifier length)
+{
+    switch (length) {
+        case LENGTH_NONE:
+        case LENGTH_HH:
+        case LENGTH_H: return ARG_INT;
+        case LENGTH_L: return ARG_LONG;
+        case LENGTH_LL: return ARG_LLONG;
+        case LENGTH_Z: return ARG_SIZE;
+        case LENGTH_J: return ARG_INTMAX;
+        case LENGTH_T: return ARG_PTRDIFF;
+        default: return ARG_UNSUPPORTED;
+    }
+}
+
+// p points at a '%'.  Returns the character after the conversion.
+static const char* parse_conversion(const char* p, conversion_t* conv)
+{
+    conv->start = p++;
+    conv->star_count = 0;
+
+    while (*p != '\0' && strchr("-+ #0", *p) != NULL)
+        p++;
+
+    if (*p == '*') {
+        conv->star_count++;
+        p++;
+    } else {
+        p = skip_digits(p);
+    }
+
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            conv->star_count++;
+            p++;
+        } else {
+            p = skip_digits(p);
+        }
+    }
+
+    length_modifier length;
+    p = parse_length(p, &length);
+
+    char c = *p;
+    if (c != '\0')
+        p++;
+    conv->end = p;
+
+    switch (c) {
+        case 'd': case 'i': case 'u': case 'x': case 'X': case 'o':
+            conv->kind = integer_kind(length);
+            break;
+        case 'c':
+            conv->kind = (LENGTH_NONE == length) ? ARG_INT : ARG_UNSUPPORTED;
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            if (LENGTH_BIG_L == length)
+                conv->kind = ARG_LDOUBLE;
+            else
+                conv->kind = (LENGTH_NONE == length || LENGTH_L == length) ? ARG_DOUBLE : ARG_UNSUPPORTED;
+            break;
+        case 's':
+            conv->kind = (LENGTH_NONE == length) ? ARG_STRING : ARG_UNSUPPORTED;
+            break;
+        case 'p':
+            conv->kind = ARG_POINTER;
+            break;
+        case '%':
+            conv->kind = ARG_NONE;
+            break;
+        default:
+            conv->kind = ARG_UNSUPPORTED;   // Including %n
+            break;
+    }
+
+    if (conv->end - conv->start > max_conversion_len)
+        conv->kind = ARG_UNSUPPORTED;
+
+    return p;
+}
+
+static size_t read_arg(arg_kind kind, va_list* args, arg_value_t* value)
 {
-    log_data_t* log_details = (log_data_t*)single_entry;
-    zlog_category_t* c = (zlog_category_t*)category;
+    switch (kind) {
+        case ARG_INT: value->i = va_arg(*args, int); return sizeof(value->i);
+        case ARG_LONG: value->l = va_arg(*args, long); return sizeof(value->l);
+        case ARG_LLONG: value->ll = va_arg(*args, long long); return sizeof(value->ll);
+        case ARG_SIZE: value->z = va_arg(*args, size_t); return sizeof(value->z);
+        case ARG_INTMAX: value->j = va_arg(*args, intmax_t); return sizeof(value->j);
+        case ARG_PTRDIFF: value->t = va_arg(*args, ptrdiff_t); return sizeof(value->t);
+        case ARG_DOUBLE: value->d = va_arg(*args, double); return sizeof(value->d);
+        case ARG_LDOUBLE: value->ld = va_arg(*args, long double); return sizeof(value->ld);
+        case ARG_POINTER: value->p = va_arg(*args, void*); return sizeof(value->p);
+        default: return 0;
+    }
+}
 
-    switch(log_details->type) {
+static bool pack_bytes(char* out, size_t capacity, size_t* len, const void* data, size_t size)
+{
+    if (*len + size > capacity)
+        return false;
+    memcpy(out + *len, data, size);
+    *len += size;
+    return true;
+}
+
+// Copies the arguments format refers to into out.  Fails if the format
+// uses a conversion deferred formatting does not handle or the arguments
+// do not fit, in which case the message should be formatted right away.
+static bool pack_args(const char* format, va_list* args, char* out, size_t capacity)
+{
+    size_t len = 0;
+
+    for (const char* p = format; *p != '\0'; ) {
+        if (*p != '%') {
+            p++;
+            continue;
+        }
+
+        conversion_t conv;
+        p = parse_conversion(p, &conv);
+        if (ARG_UNSUPPORTED == conv.kind)
+            return false;
+
+        for (int i = 0; i < conv.star_count; i++) {
+            int star = va_arg(*args, int);
+            if (!pack_bytes(out, capacity, &len, &star, sizeof(star)))
+                return false;
+        }
+
+        if (ARG_STRING == conv.kind) {
+            const char* str = va_arg(*args, const char*);
+            if (NULL == str)
+                str = "(null)";
+            if (!pack_bytes(out, capacity, &len, str, strlen(str) + 1))
+                return false;
+        } else if (conv.kind != ARG_NONE) {
+            arg_value_t value;
+            size_t size = read_arg(conv.kind, args, &value);
+            if (!pack_bytes(out, capacity, &len, &value, size))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+static size_t arg_size(arg_kind kind)
+{
+    switch (kind) {
+        case ARG_INT: return sizeof(int);
+        case ARG_LONG: return sizeof(long);
+        case ARG_LLONG: return sizeof(long long);
+        case ARG_SIZE: return sizeof(size_t);
+        case ARG_INTMAX: return sizeof(intmax_t);
+        case ARG_PTRDIFF: return sizeof(ptrdiff_t);
+        case ARG_DOUBLE: return sizeof(double);
+        case ARG_LDOUBLE: return sizeof(long double);
+        case ARG_POINTER: return sizeof(void*);
+        default: return 0;
+    }
+}
+
+// Rebuilds a single conversion with any '*' replaced by the packed value,
+// so it can be handed to snprintf on its own.
+static const char* resolve_conversion(const conversion_t* conv, const char* packed, size_t* offset, char* spec)
+{
+    size_t spec_len = 0;
+
+    for (const char* c = conv->start; c < conv->end; c++) {
+        if (*c != '*') {
+            spec[spec_len++] = *c;
+            continue;
+        }
+
+        int star;
+        memcpy(&star, packed + *offset, sizeof(star));
+        *offset += sizeof(star);
+
+        // A negative precision counts as none given.
+        if (star < 0 && c[-1] == '.') {
+            spec_len--;
+            continue;
+        }
+        spec_len += sprintf(spec + spec_len, "%d", star);
+    }
+
+    spec[spec_len] = '\0';
+    return spec;
+}
+
+static int format_arg(char* out, size_t capacity, const char* spec, arg_kind kind, const char* packed)
+{
+    arg_value_t value;
+    memcpy(&value, packed, arg_size(kind));
+
+    switch (kind) {
+        case ARG_NONE: return snprintf(out, capacity, "%%");
+        case ARG_INT: return snprintf(out, capacity, spec, value.i);
+        case ARG_LONG: return snprintf(out, capacity, spec, value.l);
+        case ARG_LLONG: return snprintf(out, capacity, spec, value.ll);
+        case ARG_SIZE: return snprintf(out, capacity, spec, value.z);
+        case ARG_INTMAX: return snprintf(out, capacity, spec, value.j);
+        case ARG_PTRDIFF: return snprintf(out, capacity, spec, value.t);
+        case ARG_DOUBLE: return snprintf(out, capacity, spec, value.d);
+        case ARG_LDOUBLE: return snprintf(out, capacity, spec, value.ld);
+        case ARG_POINTER: return snprintf(out, capacity, spec, value.p);
+        case ARG_STRING: return snprintf(out, capacity, spec, packed);
+        default: return 0;
+    }
+}
+
+// Formats a record packed by pack_args into out, truncating to capacity
+// including the terminator.  Returns the length written.
+static size_t format_deferred(const char* format, const char* packed, char* out, size_t capacity)
+{
+    size_t len = 0;
+    size_t offset = 0;
+
+    for (const char* p = format; *p != '\0' && len + 1 < capacity; ) {
+        if (*p != '%') {
+            out[len++] = *p++;
+            continue;
+        }
+
+        conversion_t conv;
+        p = parse_conversion(p, &conv);
+
+        // Each '*' can grow to an int's worth of digits.
+        char spec[max_conversion_len + 2 * 12 + 1];
+        resolve_conversion(&conv, packed, &offset, spec);
+
+        int written = format_arg(out + len, capacity - len, spec, conv.kind, packed + offset);
+        if (written > 0)
+            len += ((size_t)written < capacity - len) ? (size_t)written : capacity - len - 1;
+
+        offset += (ARG_STRING == conv.kind) ? strlen(packed + offset) + 1 : arg_size(conv.kind);
+    }
+
+    out[len] = '\0';
+    return len;
+}
+
+// Lines carry their own timestamp and level, so zlog.conf only passes the
+// message through.
+static const char* format_timestamp(time_t logged_at)
+{
+    if (logged_at != cached_second) {
+        struct tm local;
+        localtime_r(&logged_at, &local);
+        strftime(cached_timestamp, sizeof(cached_timestamp), "%F %T", &local);
+        cached_second = logged_at;
+    }
+    return cached_timestamp;
+}
+
+static void write_to_zlog(log_type type, const char* text)
+{
+    switch(type) {
         case FATAL:
-            zlog_fatal(c, log_details->msg);
-            printf("FATAL: %s\n", log_details->msg);
+            zlog_fatal(zlog_category, "%s", text);
             break;
         case ERROR:
-            zlog_error(c, log_details->msg);
-            printf("ERROR: %s\n", log_details->msg);
+            zlog_error(zlog_category, "%s", text);
             break;
         case WARN:
-            zlog_warn(c, log_details->msg);
-            printf("WARNING: %s\n", log_details->msg);
+            zlog_warn(zlog_category, "%s", text);
             break;
         case INFO:
-            zlog_info(c, log_details->msg);
-            printf("INFO: %s\n", log_details->msg);
+            zlog_info(zlog_category, "%s", text);
             break;
         case DEBUG:
         default:
-            zlog_notice(c, log_details->msg);
-            printf("DEBUG: %s\n", log_details->msg);
+            zlog_notice(zlog_category, "%s", text);
             break;
     }
 }
 
-static void log_collection_synchronous (list* logs)
+// Must be called with drain_lock held.
+static void write_batch()
+{
+    if (0 == batch_len)
+        return;
+
+    batch[batch_len] = '\0';
+    write_to_zlog(batch_type, batch);
+    fwrite(batch, 1, batch_len, stdout);
+    batch_len = 0;
+}
+
+// Must be called with drain_lock held.
+static void append_line(log_type type, time_t logged_at, const char* msg, size_t len)
+{
+    size_t max_line_len = sizeof(cached_timestamp) + 16 + len;
+    if (batch_len + max_line_len > log_batch_max_len || type != batch_type)
+        write_batch();
+    batch_type = type;
+
+    batch_len += snprintf(batch + batch_len, log_batch_max_len + 1 - batch_len, "%s -- %s: ",
+        format_timestamp(logged_at), log_type_names[type]);
+    memcpy(batch + batch_len, msg, len);
+    batch_len += len;
+    batch[batch_len++] = '\n';
+}
+
+// Must be called with drain_lock held.
+static void flush_repeats(time_t now)
+{
+    if (0 == last_msg_repeats)
+        return;
+
+    char note[64];
+    int len = snprintf(note, sizeof(note), "Last message repeated %llu times.", (unsigned long long)last_msg_repeats);
+    append_line(last_msg_type, now, note, len);
+    last_msg_repeats = 0;
+}
+
+// Must be called with drain_lock held.  msg need not be terminated and is
+// truncated to log_formatted_max_len.
+static void append_to_batch(log_type type, time_t logged_at, const char* msg, size_t len)
+{
+    if (len > log_formatted_max_len)
+        len = log_formatted_max_len;
+
+    if (type == last_msg_type && len == last_msg_len && memcmp(msg, last_msg, len) == 0) {
+        if (0 == last_msg_repeats)
+            last_msg_repeats_since = logged_at;
+        last_msg_repeats++;
+        __atomic_add_fetch(&repeated_logs, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    flush_repeats(logged_at);
+    append_line(type, logged_at, msg, len);
+
+    memcpy(last_msg, msg, len);
+    last_msg_len = len;
+    last_msg_type = type;
+}
+
+// Must be called with drain_lock held.
+static void append_record_to_batch(log_record_t* record)
+{
+    if (NULL == record->format) {
+        append_to_batch(record->type, record->logged_at, record->msg, strlen(record->msg));
+        return;
+    }
+
+    char msg[log_formatted_max_len];
+    size_t len = format_deferred(record->format, record->msg, msg, sizeof(msg));
+    append_to_batch(record->type, record->logged_at, msg, len);
+}
+
+// Must be called with drain_lock held.  For messages of any length.
+static void write_line(log_type type, time_t logged_at, const char* msg)
 {
-    list_foreach(logs, log_single_entry_synchronous, zlog_category);
+    flush_repeats(logged_at);
+    write_batch();
+
+    // Built in full, as messages here can be longer than a batch.
+    const char* timestamp = format_timestamp(logged_at);
+    size_t len = strlen(timestamp) + strlen(log_type_names[type]) + strlen(msg) + 8;
+    char* line = (char*)malloc(len);
+    snprintf(line, len, "%s -- %s: %s\n", timestamp, log_type_names[type], msg);
+
+    write_to_zlog(type, line);
+    fputs(line, stdout);
+    free(line);
+
+    // The next queued message follows this line, so it can't be a repeat
+    // of whatever came before it.
+    last_msg_len = 0;
+    last_msg_type = no_last_msg;
 }
 
-static void free_log_details(void* data, void* args)
+static log_record_t* claim_record(uint64_t* position)
 {
-    if (data) {
-        log_data_t* log_details = (log_data_t*)data;
-        free(log_details->msg);
-        free(log_details);
+    uint64_t pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+
+    for (;;) {
+        log_record_t* record = &log_ring[pos & (log_ring_capacity - 1)];
+        uint64_t sequence = __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(sequence - pos);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring_head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *position = pos;
+                return record;
+            }
+        } else if (diff < 0) {
+            return NULL;    // Full; the consumer has not got round to this slot yet
+        } else {
+            pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+        }
     }
 }
 
-static void flush_log_data (list* data)
+static void publish_record(log_record_t* record, uint64_t position)
 {
-    log_collection_synchronous(data);
+    __atomic_store_n(&record->sequence, position + 1, __ATOMIC_RELEASE);
+}
 
-    list_foreach(data, free_log_details, NULL);
-    list_free(data);
+static bool next_record_published()
+{
+    uint64_t tail = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+    log_record_t* record = &log_ring[tail & (log_ring_capacity - 1)];
+    return __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) == tail + 1;
 }
 
-static void on_flushing_thread (uv_work_t* req)
+// Must be called with drain_lock held.
+static void report_dropped_logs()
 {
-    flush_log_data((list*)req->data);
+    uint64_t dropped = __atomic_load_n(&dropped_logs, __ATOMIC_RELAXED);
+    if (dropped == reported_dropped_logs)
+        return;
+
+    char msg[128];
+    int len = snprintf(msg, sizeof(msg), "Log queue was full. Dropped %llu log messages.",
+        (unsigned long long)(dropped - reported_dropped_logs));
+    append_to_batch(WARN, time(NULL), msg, len);
+    reported_dropped_logs = dropped;
 }
 
-static void on_flushing_thread_done (uv_work_t* req, int status)
+// Writes out every published record, stopping at the first slot that is
+// still being filled in.  Pending repeats are written once they are old
+// enough, or always if flush_all is set.
+static void drain_logs(bool flush_all)
 {
-    if (0 != status)
-        log_synchronous(ERROR, "Failed to flush log to file from thread.  Error Code: %d", status);
+    uv_mutex_lock(&drain_lock);
+
+    for (;;) {
+        log_record_t* record = &log_ring[ring_tail & (log_ring_capacity - 1)];
+        if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) != ring_tail + 1)
+            break;
+
+        append_record_to_batch(record);
+
+        __atomic_store_n(&record->sequence, ring_tail + log_ring_capacity, __ATOMIC_RELEASE);
+        __atomic_store_n(&ring_tail, ring_tail + 1, __ATOMIC_RELAXED);
+    }
+
+    report_dropped_logs();
+
+    time_t now = time(NULL);
+    if (flush_all || now - last_msg_repeats_since >= log_repeat_flush_sec)
+        flush_repeats(now);
 
-    flush_ongoing = false;
+    write_batch();
+    fflush(stdout);
 
-    free(req);
+    uv_mutex_unlock(&drain_lock);
 }
 
-static void schedule_flush()
+// The sleeping flag and the record sequences are each written by one side
+// and read by the other with a full fence in between, so either the
+// writer sees the new record before sleeping or the producer sees it
+// asleep and wakes it.
+static void wake_writer()
 {
-    flush_ongoing = true;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&writer_sleeping, __ATOMIC_RELAXED))
+        return;
+
+    uv_mutex_lock(&writer_lock);
+    uv_cond_signal(&writer_wake);
+    uv_mutex_unlock(&writer_lock);
+}
+
+static void run_writer(void* arg)
+{
+    bool stopping = false;
 
-    uv_work_t* req = (uv_work_t*)malloc(sizeof(uv_work_t));
-    uv_rwlock_wrlock(&queued_logs_lock);
-    req->data = queued_logs;
-    queued_logs = NULL;
-    uv_rwlock_wrunlock(&queued_logs_lock);
+    while (!stopping) {
+        drain_logs(false);
 
-    uv_queue_work(uv_default_loop(), req, on_flushing_thread, on_flushing_thread_done);
+        uv_mutex_lock(&writer_lock);
+        __atomic_store_n(&writer_sleeping, true, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        if (!writer_stopping && !next_record_published())
+            uv_cond_timedwait(&writer_wake, &writer_lock, log_writer_idle_wait_ns);
+
+        __atomic_store_n(&writer_sleeping, false, __ATOMIC_RELAXED);
+        stopping = writer_stopping;
+        uv_mutex_unlock(&writer_lock);
+    }
+
+    drain_logs(true);
 }
 
-static list* get_queued_logs()
+static log_site_t* find_log_site(const char* format)
 {
-    if (NULL == queued_logs)
-        queued_logs = list_init();
-    return queued_logs;
+    size_t index = ((uintptr_t)format >> 3) & (log_site_table_size - 1);
+
+    for (size_t probe = 0; probe < log_site_table_size; probe++) {
+        log_site_t* site = &log_sites[(index + probe) & (log_site_table_size - 1)];
+        const char* key = __atomic_load_n(&site->format, __ATOMIC_ACQUIRE);
+
+        if (key == format)
+            return site;
+
+        if (NULL == key) {
+            const char* expected = NULL;
+            if (__atomic_compare_exchange_n(&site->format, &expected, format, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ||
+                expected == format)
+                return site;
+        }
+    }
+
+    return NULL;
 }
 
-static void queue_log_generic(list* log_list, log_type type, const char* msg, va_list args)
+// Takes a token from the site's bucket if it has one.
+static bool take_log_token(log_site_t* site)
 {
-    if (NULL == msg || NULL == log_list)
+    uint64_t now_ms = (uv_hrtime() / 1000000) & ((1ULL << (64 - token_bits)) - 1);
+    uint64_t max_tokens = (uint64_t)log_rate_limit_burst * token_scale;
+    uint64_t bucket = __atomic_load_n(&site->bucket, __ATOMIC_RELAXED);
+
+    for (;;) {
+        uint64_t refilled_ms = bucket >> token_bits;
+        uint64_t tokens = bucket & ((1ULL << token_bits) - 1);
+
+        // Tokens per second is thousandths per millisecond.
+        uint64_t elapsed_ms = now_ms - refilled_ms;
+        if (elapsed_ms > max_tokens)
+            tokens = max_tokens;
+        else
+            tokens += elapsed_ms * log_rate_limit_per_sec;
+        if (tokens > max_tokens)
+            tokens = max_tokens;
+
+        if (tokens < (uint64_t)token_scale)
+            return false;
+
+        uint64_t updated = (now_ms << token_bits) | (tokens - token_scale);
+        if (__atomic_compare_exchange_n(&site->bucket, &bucket, updated, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return true;
+    }
+}
+
+static void enqueue_log(log_type type, const char* msg, va_list args)
+{
+    if (NULL == msg)
         return;
 
-    char* full_message = generate_str_from_args(msg, args);
-    
-    log_data_t* data = (log_data_t*)malloc(sizeof(log_data_t));
-    data ->type = type;
-    data ->msg = full_message;
+    uint64_t position;
+    log_record_t* record = claim_record(&position);
+
+    while (NULL == record) {
+        if (LOG_OVERFLOW_DROP == log_overflow) {
+            __atomic_add_fetch(&dropped_logs, 1, __ATOMIC_RELAXED);
+            return;
+        }
 
-    list_append(log_list, data);
+        // Blocking: help the writer empty the ring.
+        drain_logs(false);
+        record = claim_record(&position);
+    }
+
+    record->type = type;
+    record->logged_at = time(NULL);
+    record->format = NULL;
+
+    va_list packed_args;
+    va_copy(packed_args, args);
+    if (log_deferred_formatting && pack_args(msg, &packed_args, record->msg, log_record_max_len))
+        record->format = msg;
+    else
+        vsnprintf(record->msg, log_record_max_len, msg, args);
+    va_end(packed_args);
+
+    publish_record(record, position);
+
+    wake_writer();
+}
+
+static void enqueue_log_args(log_type type, const char* msg, ...)
+{
+    va_list args;
+    va_start(args, msg);
+    enqueue_log(type, msg, args);
+    va_end(args);
 }
 
 static void queue_log(log_type type, const char* msg, va_list args)
 {
-    uv_rwlock_wrlock(&queued_logs_lock);
-    queue_log_generic(get_queued_logs(), type, msg, args);
-    uv_rwlock_wrunlock(&queued_logs_lock);
+    log_site_t* site = (NULL == msg) ? NULL : find_log_site(msg);
+
+    if (site != NULL) {
+        if (!take_log_token(site)) {
+            __atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&rate_limited_logs, 1, __ATOMIC_RELAXED);
+            return;
+        }
+
+        uint64_t suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+        if (suppressed > 0)
+            enqueue_log_args(WARN, "Rate limit suppressed %llu messages like \"%s\".", (unsigned long long)suppressed, msg);
+    }
 
-    if (!flush_ongoing)
-        schedule_flush();
+    enqueue_log(type, msg, args);
 }
 
 static bool set_init_state(bool state)
@@ -205,18 +842,16 @@ void log_synchronous (log_type type, const char* msg, ...)
     va_list args;
     va_start(args, msg);
 
-    log_data_t* data = (log_data_t*)malloc(sizeof(log_data_t));
-    data->type = type;
-    data->msg = generate_str_from_args(msg, args);
-
-    list* log_list = list_init();
-    list_append(log_list, data);
+    char* full_message = generate_str_from_args(msg, args);
 
-    log_collection_synchronous(log_list);
+    // Anything already queued goes out first.
+    drain_logs(true);
+    uv_mutex_lock(&drain_lock);
+    write_line(type, time(NULL), full_message);
+    fflush(stdout);
+    uv_mutex_unlock(&drain_lock);
 
-    free(data->msg);
-    free(data);
-    list_free(log_list);
+    free(full_message);
 
     va_end(args);
 }
@@ -226,10 +861,25 @@ void force_log_flush()
     if (!verify_init()) 
         return;
 
-    uv_rwlock_wrlock(&queued_logs_lock);
-    flush_log_data(get_queued_logs());
-    queued_logs = NULL;
-    uv_rwlock_wrunlock(&queued_logs_lock);
+    drain_logs(true);
+}
+
+uint64_t get_dropped_log_count()
+{
+    return __atomic_load_n(&dropped_logs, __ATOMIC_RELAXED);
+}
+
+uint64_t get_log_queue_depth()
+{
+    uint64_t tail = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+    uint64_t head = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+    return (head > tail) ? head - tail : 0;
+}
+
+void get_suppressed_log_counts(uint64_t* rate_limited, uint64_t* repeated)
+{
+    *rate_limited = __atomic_load_n(&rate_limited_logs, __ATOMIC_RELAXED);
+    *repeated = __atomic_load_n(&repeated_logs, __ATOMIC_RELAXED);
 }
 
 bool init_logger()
@@ -248,13 +898,33 @@ bool init_logger()
         return false;
     }
 
+    for (uint64_t i = 0; i < log_ring_capacity; i++)
+        log_ring[i].sequence = i;
+
+    uv_mutex_init(&drain_lock);
+    uv_mutex_init(&writer_lock);
+    uv_cond_init(&writer_wake);
+    writer_stopping = false;
+
+    if (uv_thread_create(&writer_thread, run_writer, NULL) != 0) {
+        printf("Could not start the log writer thread.\n");
+        return false;
+    }
+
     set_init_state(true);
     return true;
 }
 
 void shutdown_logger()
 {
-    force_log_flush();
+    if (logger_initialized) {
+        uv_mutex_lock(&writer_lock);
+        writer_stopping = true;
+        uv_cond_signal(&writer_wake);
+        uv_mutex_unlock(&writer_lock);
+        uv_thread_join(&writer_thread);
+    }
+
     zlog_fini();
     set_init_state(false);
 }
\ No newline at end of file
@@ -6,48 +6,126 @@
 #include "serialization.h"
 #include "time_utils.h"
 #include "web_interface.h"
+#include "ingest.h"
+#include "metrics.h"
 
 #define VERSION    0.1
 
 static char* listen_ip_addr = "0.0.0.0";
 static const int   listen_port    = 12001;
+static const bool  udp_ingest_enabled = false;    // Opt in to also accept reports as datagrams on listen_port
+static const int   ingest_thread_count = 1;       // More than one runs an SO_REUSEPORT listener per thread
 
 static uv_timer_t* outage_timer;
-static const int outage_timer_interval_ms = 60000;   
-static const int outage_timer_threshold_sec = 120;
+static const int outage_timer_interval_ms = 1000;
+
+// SIGINT, SIGTERM and SIGHUP shut upkeep down.  SIGUSR1 logs a summary of
+// the per-stage latencies.
+#define shutdown_signal_count 3
+static const int shutdown_signal_numbers[shutdown_signal_count] = { SIGINT, SIGTERM, SIGHUP };
+static uv_signal_t shutdown_signals[shutdown_signal_count];
+static uv_signal_t latency_dump_signal;
+static bool shutting_down = false;
+
+// Reboot broadcasts run on the thread pool; queued_at times the wait for a
+// free thread.
+typedef struct reboot_work_t {
+    uv_work_t req;
+    uptime_entry_t* entry;
+    uint64_t queued_at;
+} reboot_work_t;
+
+// Reboot work broadcasts through the web interface, so shutdown stops
+// queueing it and waits for what is in flight before the webserver goes.
+static uv_mutex_t reboot_work_lock;
+static uv_cond_t reboot_work_done;
+static int reboot_work_in_flight = 0;
+static bool accepting_reboot_work = true;
+
+void drain_reboot_work();
+
+void log_latency_summary()
+{
+    for (int stage = 0; stage < METRIC_STAGE_COUNT; stage++) {
+        metrics_latency_summary summary;
+        metrics_summarize_latency(stage, &summary);
+        if (0 == summary.count)
+            continue;
+
+        log_info("Latency of %s over %llu samples: mean %.1fus, p50 %.1fus, p90 %.1fus, p99 %.1fus, p99.9 %.1fus, max %.1fus.",
+            metrics_stage_name(stage), (unsigned long long)summary.count, summary.sum_ns / 1000.0 / summary.count,
+            summary.p50_ns / 1000.0, summary.p90_ns / 1000.0, summary.p99_ns / 1000.0,
+            summary.p999_ns / 1000.0, summary.max_ns / 1000.0);
+    }
+}
 
 void shutdown_upkeep(int return_code)
 {
+    // lws watches SIGINT and SIGTERM as well, so the same signal can get
+    // here twice.
+    if (shutting_down)
+        return;
+    shutting_down = true;
+
     log_info("Upkeep terminating.");
 
+    uint64_t read_buffer_hits, read_buffer_misses;
+    get_read_buffer_stats(&read_buffer_hits, &read_buffer_misses);
+    log_info("Read buffer pool: %llu hits, %llu misses.",
+        (unsigned long long)read_buffer_hits, (unsigned long long)read_buffer_misses);
+
+    int open_connections;
+    uint64_t rejected_connections, idle_connections;
+    get_connection_stats(&open_connections, &rejected_connections, &idle_connections);
+    log_info("Connections: %d open, %llu refused at the limit, %llu closed while idle.", open_connections,
+        (unsigned long long)rejected_connections, (unsigned long long)idle_connections);
+
+    log_latency_summary();
+
     if(outage_timer) {
         if (uv_is_active((uv_handle_t*)outage_timer))
             uv_timer_stop(outage_timer);
         free(outage_timer);
     }
 
+    shutdown_ingest();
+
+    drain_reboot_work();
+
     shutdown_webserver();
+
+    shutdown_database();
     
     shutdown_logger();
 
     exit(0);
 }
 
-void register_interrupt_handlers()
+void on_shutdown_signal(uv_signal_t* handle, int signum)
 {
-    signal(SIGINT, shutdown_upkeep);
-    signal(SIGTERM, shutdown_upkeep);
-    signal(SIGHUP, shutdown_upkeep);
+    log_info("Received signal %d.", signum);
+    shutdown_upkeep(signum);
 }
 
-void alloc_buffer(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) 
+void on_latency_dump_signal(uv_signal_t* handle, int signum)
 {
-    *buf = uv_buf_init((char*) malloc(suggested_size), suggested_size);
+    log_latency_summary();
 }
 
-void on_close (uv_handle_t* handle) 
-{ 
-    free(handle); 
+void register_interrupt_handlers()
+{
+    // Handled on the loop rather than in a signal handler, so shutdown is
+    // free to log, take locks and free memory.  Unreferenced so they don't
+    // keep the loop running on their own.
+    for (int i = 0; i < shutdown_signal_count; i++) {
+        uv_signal_init(uv_default_loop(), &shutdown_signals[i]);
+        uv_signal_start(&shutdown_signals[i], on_shutdown_signal, shutdown_signal_numbers[i]);
+        uv_unref((uv_handle_t*)&shutdown_signals[i]);
+    }
+
+    uv_signal_init(uv_default_loop(), &latency_dump_signal);
+    uv_signal_start(&latency_dump_signal, on_latency_dump_signal, SIGUSR1);
+    uv_unref((uv_handle_t*)&latency_dump_signal);
 }
 
 void submit_report_to_webserver(uptime_entry_t* record)
@@ -61,35 +139,66 @@ void submit_report_to_webserver(uptime_entry_t* record)
     free(report);
 }
 
-void on_device_reboot(uv_work_t* req)
+void init_reboot_work()
 {
-    uptime_entry_t* data = (uptime_entry_t*)req->data;
-    submit_report_to_webserver(data);
+    uv_mutex_init(&reboot_work_lock);
+    uv_cond_init(&reboot_work_done);
 }
 
-void on_device_reboot_processed(uv_work_t* req, int status)
+// Called on the loop that received the report.  False once shutdown has
+// started draining.
+bool start_reboot_work()
 {
-    free_uptime_entry_t((uptime_entry_t*)req->data);
+    uv_mutex_lock(&reboot_work_lock);
+    bool accepted = accepting_reboot_work;
+    if (accepted)
+        reboot_work_in_flight++;
+    uv_mutex_unlock(&reboot_work_lock);
+    return accepted;
 }
 
-void on_device_timeout(uptime_entry_t* record)
+void drain_reboot_work()
 {
-    submit_report_to_webserver(record);
+    uv_mutex_lock(&reboot_work_lock);
+    accepting_reboot_work = false;
+    while (reboot_work_in_flight > 0)
+        uv_cond_wait(&reboot_work_done, &reboot_work_lock);
+    uv_mutex_unlock(&reboot_work_lock);
 }
 
-void assess_timeout_criteria(uptime_entry_t* entry, void* current_time)
+void on_device_reboot(uv_work_t* req)
 {
-    if (((time_t)current_time - entry->last_update) > outage_timer_threshold_sec )
-        on_device_timeout(entry);
+    reboot_work_t* work = (reboot_work_t*)req;
+    metrics_record_latency(STAGE_REBOOT_QUEUE_WAIT, work->queued_at);
+    submit_report_to_webserver(work->entry);
+
+    // Done here rather than in on_device_reboot_processed, which needs the
+    // loop that shutdown may be blocking.
+    uv_mutex_lock(&reboot_work_lock);
+    if (--reboot_work_in_flight == 0)
+        uv_cond_signal(&reboot_work_done);
+    uv_mutex_unlock(&reboot_work_lock);
 }
 
-void on_outage_timer(uv_timer_t* handle)
+void on_device_reboot_processed(uv_work_t* req, int status)
 {
-    uptime_record* record = get_uptime_record();
+    reboot_work_t* work = (reboot_work_t*)req;
+    free_uptime_entry_t(work->entry);
+    free(work);
+}
 
-    uptime_record_foreach(record, assess_timeout_criteria, (void*) get_current_time());
-    
-    free_uptime_record(record);
+void on_device_timeout(uptime_entry_t* record, void* args)
+{
+    log_info("Detected outage for device [%s].  No report received in %d seconds.",
+        record->description, outage_threshold_sec);
+    metrics_count(METRIC_OUTAGES_DETECTED, 1);
+
+    submit_report_to_webserver(record);
+}
+
+void on_outage_timer(uv_timer_t* handle)
+{
+    check_for_outages(get_current_time(), on_device_timeout, NULL);
 }
 
 void start_outage_timer()
@@ -104,103 +213,49 @@ void start_outage_timer()
     uv_timer_start(outage_timer, on_outage_timer, outage_timer_interval_ms, outage_timer_interval_ms);
 }
 
-uptime_entry_t* store_uptime_report_in_db(uptime_report_t* report)
+// The entry borrows the report's strings; the database keeps its own copy.
+void store_uptime_report_in_db(uptime_report_t* report, uptime_entry_t* entry)
 {
-    uptime_entry_t* entry = (uptime_entry_t*)malloc(sizeof(uptime_entry_t));
-
-    entry->mac_address = strdup(report->mac_address);
-    entry->description = strdup(report->description);
+    entry->mac_address = report->mac_address;
+    entry->description = report->description;
     entry->uptime = report->uptime;
     entry->last_update = get_current_time();
     
-    insert_uptime_entry(entry);
+    uint64_t started_at = metrics_now();
+    queue_uptime_entry(entry);
+    metrics_record_latency(STAGE_QUEUE_UPTIME_ENTRY, started_at);
 }
 
-void register_uptime_report (uptime_report_t* report)
+// Called on whichever ingest loop received the report.
+void register_uptime_report (uptime_report_t* report, uv_loop_t* loop)
 {
-    time_t current_time = get_current_time();
-    
-    char* current_time_str = print_time_local(current_time);
-    log_info("Report recieved from [%s] at time %s", report->description, current_time_str);
-    free(current_time_str);
+    uint64_t registered_at = metrics_now();
+
+    // The log line carries its own timestamp.
+    log_info("Report recieved from [%s]", report->description);
 
+    uint64_t started_at = metrics_now();
     uint32_t last_recorded_uptime = get_last_known_uptime(report->mac_address);
+    metrics_record_latency(STAGE_GET_LAST_KNOWN_UPTIME, started_at);
 
-    uptime_entry_t* entry = store_uptime_report_in_db(report);
+    uptime_entry_t entry;
+    store_uptime_report_in_db(report, &entry);
 
-    if(last_recorded_uptime > entry->uptime || entry->uptime < 5000) {
+    // The report is gone once this returns, so the reboot work gets a copy.
+    if(last_recorded_uptime > entry.uptime || entry.uptime < 5000) {
         log_info("Detected reboot for device [%s].  Old uptime: %d.  New uptime: %d", 
-            entry->description, last_recorded_uptime, entry->uptime);
-        
-        uv_work_t* req = (uv_work_t*)malloc(sizeof(uv_work_t));
-        req->data = entry;
-        uv_queue_work(uv_default_loop(), req, on_device_reboot, on_device_reboot_processed);
-    } else {
-        free_uptime_entry_t(entry);
+            entry.description, last_recorded_uptime, entry.uptime);
+        metrics_count(METRIC_REBOOTS_DETECTED, 1);
+
+        if (start_reboot_work()) {
+            reboot_work_t* work = (reboot_work_t*)malloc(sizeof(reboot_work_t));
+            work->entry = copy_uptime_entry_t(&entry);
+            work->queued_at = metrics_now();
+            uv_queue_work(loop, &work->req, on_device_reboot, on_device_reboot_processed);
+        }
     }
-}
-
-void on_read_unit_complete(uv_stream_t* client, ssize_t nread, const uv_buf_t* buf)
-{
-    uptime_report_t* uptime_data;
-
-    if (0 == nread)
-        goto cleanup;
 
-    if (nread < 0) {
-        uv_close((uv_handle_t*) client, on_close);
-        const char* err = uv_err_name(nread);    // (per the docs) leaks a few bytes of memory for unknown err code
-        const char* msg = uv_strerror(nread);    // ^^^
-        log_error("Error reading message from new connection: LibUV err [%s], LibUv msg [{%s}].", err, msg);
-        goto cleanup;
-    } 
-
-    uptime_data = deserialize_report(buf->base, nread);
-    if (uptime_data != NULL) {
-        register_uptime_report(uptime_data);
-        free_uptime_report_t(uptime_data);
-    }
-        
-    cleanup:
-    if (buf->base)
-        free(buf->base);
-}
-
-void on_new_connection(uv_stream_t *server, int status) 
-{
-    if (status < 0) {
-        log_error("on_new_connection -- New connection error %s\n", uv_strerror(status));
-        return;
-    }
-
-    uv_tcp_t* client = (uv_tcp_t*) malloc(sizeof(uv_tcp_t));
-    uv_tcp_init(uv_default_loop(), client);
-    
-    if (uv_accept(server, (uv_stream_t*) client) == 0) 
-        uv_read_start((uv_stream_t*) client, alloc_buffer, (uv_read_cb)server->data);
-    else
-        uv_close((uv_handle_t*) client, NULL);
-
-    start_outage_timer();
-}
-
-void listen_for_connections()
-{
-    static uv_tcp_t server;
-    uv_tcp_init(uv_default_loop(), &server);
-
-    struct sockaddr_in addr;
-    uv_ip4_addr(listen_ip_addr, listen_port, &addr);
-    uv_tcp_bind(&server, (const struct sockaddr*)&addr, 0);
-
-    server.data = (void*)on_read_unit_complete;
-
-    int listen_resp = uv_listen((uv_stream_t*) &server, 500, on_new_connection);
-    if (listen_resp != 0) {
-        log_error("listen_for_connections -- listen error: %s, %s.",
-            uv_err_name(listen_resp),  uv_strerror(listen_resp));
-        shutdown_upkeep(-1);
-    }
+    metrics_record_latency(STAGE_REGISTER_UPTIME_REPORT, registered_at);
 }
 
 int main (int argc, char** argv)
@@ -220,11 +275,19 @@ int main (int argc, char** argv)
 
     register_interrupt_handlers();
 
+    init_reboot_work();
+
     init_database();
 
-    listen_for_connections();
+    if (!listen_for_reports(listen_ip_addr, listen_port, ingest_thread_count, register_uptime_report))
+        shutdown_upkeep(-1);
+
+    if (udp_ingest_enabled && !listen_for_datagrams(listen_ip_addr, listen_port, register_uptime_report))
+        shutdown_upkeep(-1);
+
+    start_outage_timer();
 
-    init_webserver();
+    init_webserver(shutdown_upkeep);
 
     force_log_flush();
 
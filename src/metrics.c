@@ -0,0 +1,323 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "uv.h"
+#include "metrics.h"
+
+// Latencies are kept in HDR-style log-linear buckets: exact below
+// 2^(latency_sub_bucket_bits + 1) ns, then each power of two is split into
+// 2^latency_sub_bucket_bits equal buckets, so any recorded value is within
+// 12.5% of the truth.  Values past latency_max_bits (about 4.5 minutes)
+// are clamped into the last bucket.
+#define latency_sub_bucket_bits 3
+#define latency_sub_bucket_count (1 << latency_sub_bucket_bits)
+#define latency_max_bits 38
+#define latency_bucket_count ((latency_max_bits - latency_sub_bucket_bits + 1) * latency_sub_bucket_count)
+
+// Powers of two line up with bucket boundaries, so they make exact
+// Prometheus buckets: 2^10 ns (about 1us) up to 2^37 ns.
+static const int exported_bound_min_bits = 10;
+
+typedef struct latency_histogram_t {
+    uint64_t buckets[latency_bucket_count];
+    uint64_t sum_ns;
+    uint64_t max_ns;
+} latency_histogram_t;
+
+// Written only by the thread that owns it.  Blocks are never freed, so a
+// thread's counts outlive it.
+typedef struct metrics_block_t {
+    uint64_t counters[METRIC_COUNTER_COUNT];
+    latency_histogram_t latencies[METRIC_STAGE_COUNT];
+    struct metrics_block_t* next;
+} metrics_block_t;
+
+static metrics_block_t* blocks = NULL;
+static __thread metrics_block_t* thread_block = NULL;
+
+static const char* counter_names[METRIC_COUNTER_COUNT][2] = {
+    {"upkeep_connections_accepted_total", "TCP connections accepted."},
+    {"upkeep_connections_refused_total", "TCP connections closed at the connection limit."},
+    {"upkeep_reads_total", "Reads from TCP connections."},
+    {"upkeep_read_bytes_total", "Bytes read from TCP connections."},
+    {"upkeep_datagrams_received_total", "Report datagrams received."},
+    {"upkeep_datagrams_dropped_total", "Report datagrams dropped as truncated or malformed."},
+    {"upkeep_reports_decoded_total", "Uptime reports decoded."},
+    {"upkeep_decode_failures_total", "Uptime reports that failed to decode."},
+    {"upkeep_reboots_detected_total", "Device reboots detected."},
+    {"upkeep_outages_detected_total", "Device outages detected."},
+    {"upkeep_entries_committed_total", "Uptime entries committed to the database."},
+    {"upkeep_entries_dropped_total", "Uptime entries dropped with too many waiting to be committed."},
+    {"upkeep_broadcasts_total", "Reports broadcast to websocket clients."},
+    {"upkeep_ws_frames_sent_total", "Websocket frames written to clients."},
+    {"upkeep_ws_lagging_clients_total", "Websocket clients that fell behind the broadcast log."},
+};
+
+static const char* stage_names[METRIC_STAGE_COUNT] = {
+    "accept",
+    "read",
+    "assemble_report",
+    "deserialize_report",
+    "register_uptime_report",
+    "get_last_known_uptime",
+    "queue_uptime_entry",
+    "reboot_queue_wait",
+    "insert_uptime_entry",
+    "commit_wait",
+    "broadcast_report",
+};
+
+static metrics_block_t* get_thread_block()
+{
+    if (thread_block != NULL)
+        return thread_block;
+
+    metrics_block_t* block = (metrics_block_t*)calloc(1, sizeof(metrics_block_t));
+    block->next = __atomic_load_n(&blocks, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&blocks, &block->next, block, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+
+    thread_block = block;
+    return block;
+}
+
+// Only the owning thread writes, so a relaxed store of the new value is
+// enough for the renderer to read it without tearing.
+static void add(uint64_t* value, uint64_t n)
+{
+    __atomic_store_n(value, *value + n, __ATOMIC_RELAXED);
+}
+
+static uint64_t load(const uint64_t* value)
+{
+    return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+void metrics_count(metric_counter counter, uint64_t n)
+{
+    add(&get_thread_block()->counters[counter], n);
+}
+
+uint64_t metrics_now()
+{
+    return uv_hrtime();
+}
+
+static int get_bucket(uint64_t ns)
+{
+    if (ns < 2 * latency_sub_bucket_count)
+        return (int)ns;
+    if (ns >> latency_max_bits)
+        return latency_bucket_count - 1;
+
+    int shift = (63 - __builtin_clzll(ns)) - latency_sub_bucket_bits;
+    return shift * latency_sub_bucket_count + (int)(ns >> shift);
+}
+
+// The largest value that lands in bucket.
+static uint64_t get_bucket_limit(int bucket)
+{
+    if (bucket < 2 * latency_sub_bucket_count)
+        return bucket;
+
+    int shift = bucket / latency_sub_bucket_count - 1;
+    uint64_t sub_bucket = bucket - shift * latency_sub_bucket_count;
+    return ((sub_bucket + 1) << shift) - 1;
+}
+
+void metrics_record_latency(metric_stage stage, uint64_t started_at)
+{
+    metrics_record_interval(stage, started_at, uv_hrtime());
+}
+
+void metrics_record_interval(metric_stage stage, uint64_t started_at, uint64_t ended_at)
+{
+    uint64_t ns = (ended_at > started_at) ? ended_at - started_at : 0;
+    latency_histogram_t* histogram = &get_thread_block()->latencies[stage];
+
+    add(&histogram->buckets[get_bucket(ns)], 1);
+    add(&histogram->sum_ns, ns);
+    if (ns > histogram->max_ns)
+        __atomic_store_n(&histogram->max_ns, ns, __ATOMIC_RELAXED);
+}
+
+// Histograms of the same stage merge by adding their buckets.
+static void merge_latencies(metric_stage stage, latency_histogram_t* total)
+{
+    memset(total, 0, sizeof(latency_histogram_t));
+
+    for (metrics_block_t* block = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); block != NULL; block = block->next) {
+        latency_histogram_t* histogram = &block->latencies[stage];
+        for (int i = 0; i < latency_bucket_count; i++)
+            total->buckets[i] += load(&histogram->buckets[i]);
+        total->sum_ns += load(&histogram->sum_ns);
+
+        uint64_t max_ns = load(&histogram->max_ns);
+        if (max_ns > total->max_ns)
+            total->max_ns = max_ns;
+    }
+}
+
+// The value that a fraction quantile of samples are at or below, to
+// within a bucket.
+static uint64_t get_quantile(const latency_histogram_t* histogram, uint64_t count, double quantile)
+{
+    uint64_t rank = (uint64_t)(quantile * count + 0.5);
+    if (rank < 1)
+        rank = 1;
+
+    uint64_t cumulative = 0;
+    for (int i = 0; i < latency_bucket_count; i++) {
+        cumulative += histogram->buckets[i];
+        if (cumulative >= rank) {
+            uint64_t limit = get_bucket_limit(i);
+            return (limit < histogram->max_ns) ? limit : histogram->max_ns;
+        }
+    }
+    return histogram->max_ns;
+}
+
+const char* metrics_stage_name(metric_stage stage)
+{
+    return stage_names[stage];
+}
+
+void metrics_summarize_latency(metric_stage stage, metrics_latency_summary* summary)
+{
+    latency_histogram_t total;
+    merge_latencies(stage, &total);
+
+    // The count is taken from the buckets rather than kept separately, so
+    // the two always agree.
+    summary->count = 0;
+    for (int i = 0; i < latency_bucket_count; i++)
+        summary->count += total.buckets[i];
+
+    summary->sum_ns = total.sum_ns;
+    summary->max_ns = total.max_ns;
+    summary->p50_ns = get_quantile(&total, summary->count, 0.5);
+    summary->p90_ns = get_quantile(&total, summary->count, 0.9);
+    summary->p99_ns = get_quantile(&total, summary->count, 0.99);
+    summary->p999_ns = get_quantile(&total, summary->count, 0.999);
+}
+
+static void reserve_text(metrics_text* text, size_t needed)
+{
+    if (text->len + needed < text->capacity)
+        return;
+
+    text->capacity = (text->len + needed) * 2;
+    text->data = (char*)realloc(text->data, text->capacity);
+}
+
+void metrics_append(metrics_text* text, const char* format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    int len = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    if (len < 0)
+        return;
+
+    reserve_text(text, len + 1);
+
+    va_start(args, format);
+    vsnprintf(text->data + text->len, text->capacity - text->len, format, args);
+    va_end(args);
+
+    text->len += len;
+}
+
+void metrics_append_value(metrics_text* text, const char* name, const char* type, const char* help, double value)
+{
+    metrics_append(text, "# HELP %s %s\n# TYPE %s %s\n%s %.17g\n", name, help, name, type, name, value);
+}
+
+static void render_counters(metrics_text* text)
+{
+    uint64_t totals[METRIC_COUNTER_COUNT] = {0};
+
+    for (metrics_block_t* block = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); block != NULL; block = block->next) {
+        for (int i = 0; i < METRIC_COUNTER_COUNT; i++)
+            totals[i] += load(&block->counters[i]);
+    }
+
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+        const char* name = counter_names[i][0];
+        metrics_append(text, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+            name, counter_names[i][1], name, name, (unsigned long long)totals[i]);
+    }
+}
+
+static void render_latencies(metrics_text* text)
+{
+    static const char* name = "upkeep_stage_latency_seconds";
+
+    metrics_append(text, "# HELP %s Time spent in each stage of handling a report.\n# TYPE %s histogram\n", name, name);
+
+    for (int stage = 0; stage < METRIC_STAGE_COUNT; stage++) {
+        latency_histogram_t total;
+        merge_latencies(stage, &total);
+
+        // Buckets are cumulative in the exposition format.
+        uint64_t cumulative = 0;
+        int bucket = 0;
+        for (int bits = exported_bound_min_bits; bits < latency_max_bits; bits++) {
+            uint64_t bound = (uint64_t)1 << bits;
+            for (; bucket < latency_bucket_count && get_bucket_limit(bucket) < bound; bucket++)
+                cumulative += total.buckets[bucket];
+            metrics_append(text, "%s_bucket{stage=\"%s\",le=\"%.9g\"} %llu\n",
+                name, stage_names[stage], bound / 1e9, (unsigned long long)cumulative);
+        }
+        for (; bucket < latency_bucket_count; bucket++)
+            cumulative += total.buckets[bucket];
+
+        metrics_append(text, "%s_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n",
+            name, stage_names[stage], (unsigned long long)cumulative);
+        metrics_append(text, "%s_sum{stage=\"%s\"} %.9f\n", name, stage_names[stage], total.sum_ns / 1e9);
+        metrics_append(text, "%s_count{stage=\"%s\"} %llu\n", name, stage_names[stage], (unsigned long long)cumulative);
+    }
+}
+
+// Percentiles straight from the full resolution histograms, for reading
+// without a Prometheus server to compute them.
+static void render_latency_quantiles(metrics_text* text)
+{
+    static const char* name = "upkeep_stage_latency_quantile_seconds";
+
+    metrics_append(text, "# HELP %s Latency percentiles of each stage since startup.\n# TYPE %s gauge\n", name, name);
+
+    for (int stage = 0; stage < METRIC_STAGE_COUNT; stage++) {
+        metrics_latency_summary summary;
+        metrics_summarize_latency(stage, &summary);
+        if (0 == summary.count)
+            continue;
+
+        const struct { const char* label; uint64_t ns; } quantiles[] = {
+            {"0.5", summary.p50_ns}, {"0.9", summary.p90_ns}, {"0.99", summary.p99_ns},
+            {"0.999", summary.p999_ns}, {"1", summary.max_ns}
+        };
+        for (int i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+            metrics_append(text, "%s{stage=\"%s\",quantile=\"%s\"} %.9f\n",
+                name, stage_names[stage], quantiles[i].label, quantiles[i].ns / 1e9);
+        }
+    }
+}
+
+void metrics_render(metrics_text* text)
+{
+    render_counters(text);
+    render_latencies(text);
+    render_latency_quantiles(text);
+}
+
+void metrics_text_free(metrics_text* text)
+{
+    free(text->data);
+    text->data = NULL;
+    text->len = 0;
+    text->capacity = 0;
+}
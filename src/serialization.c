@@ -2,42 +2,244 @@
 #include <stdlib.h>
 #include <string.h>
 #include "logger.h"
+#include "arena.h"
 #include "serialization.h"
 #include "uptime_report_msg.pb-c.h"
 
 
-uptime_report_t* deserialize_report (const char* buffer, int len)
-{    
-    UptimeReportMsg* msg = uptime_report_msg__unpack(NULL, len, (uint8_t*)buffer);
+static void* arena_protobuf_alloc(void* allocator_data, size_t size)
+{
+    return arena_alloc((struct arena*)allocator_data, size);
+}
 
-    if (NULL == msg) {
-        log_error("Failed to deserialize an incoming packet into an uptime report.");
-        return NULL;
+// Everything goes when the arena is reset.
+static void arena_protobuf_free(void* allocator_data, void* pointer)
+{
+}
+
+// Protobuf wire types and the tags of uptime_report_msg's fields.
+enum {
+    wire_type_varint = 0,
+    wire_type_length_delimited = 2
+};
+
+enum {
+    tag_mac_address = (1 << 3) | wire_type_length_delimited,
+    tag_description = (2 << 3) | wire_type_length_delimited,
+    tag_uptime = (3 << 3) | wire_type_varint
+};
+
+// Unlike a stream prefix, a varint cut short by the end of a message is
+// just as malformed as an overlong one.
+static bool read_varint(const uint8_t* buf, size_t len, size_t* offset, uint64_t* value)
+{
+    int read = decode_varint(buf + *offset, len - *offset, value);
+    if (read <= 0)
+        return false;
+    *offset += read;
+    return true;
+}
+
+static bool read_string(const uint8_t* buf, size_t len, size_t* offset, string_view_t* view)
+{
+    uint64_t string_len;
+    if (!read_varint(buf, len, offset, &string_len) || string_len > len - *offset)
+        return false;
+
+    view->data = (const char*)buf + *offset;
+    view->len = string_len;
+    *offset += string_len;
+    return true;
+}
+
+report_decode_result decode_report_view(const uint8_t* buf, size_t len, uptime_report_view_t* view)
+{
+    bool have_mac_address = false;
+    bool have_description = false;
+    bool have_uptime = false;
+    size_t offset = 0;
+
+    // As with protobuf, the last occurrence of a field wins.
+    while (offset < len) {
+        uint64_t tag, value;
+        if (!read_varint(buf, len, &offset, &tag))
+            return REPORT_DECODE_MALFORMED;
+
+        switch (tag) {
+            case tag_mac_address:
+                if (!read_string(buf, len, &offset, &view->mac_address))
+                    return REPORT_DECODE_MALFORMED;
+                have_mac_address = true;
+                break;
+            case tag_description:
+                if (!read_string(buf, len, &offset, &view->description))
+                    return REPORT_DECODE_MALFORMED;
+                have_description = true;
+                break;
+            case tag_uptime:
+                if (!read_varint(buf, len, &offset, &value))
+                    return REPORT_DECODE_MALFORMED;
+                view->uptime = (uint32_t)value;     // Truncated the way protobuf does
+                have_uptime = true;
+                break;
+            default:
+                return REPORT_DECODE_UNRECOGNIZED;
+        }
     }
 
-    uptime_report_t* retval = (uptime_report_t*) malloc(sizeof(uptime_report_t));
-    retval->mac_address = strdup(msg->mac_address);
-    retval->description = strdup(msg->description);
+    if (!have_mac_address || !have_description || !have_uptime)
+        return REPORT_DECODE_MALFORMED;
+
+    return REPORT_DECODE_OK;
+}
+
+size_t get_varint_size(uint64_t value)
+{
+    size_t size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+size_t get_report_view_size(const uptime_report_view_t* view)
+{
+    return 1 + get_varint_size(view->mac_address.len) + view->mac_address.len +
+           1 + get_varint_size(view->description.len) + view->description.len +
+           1 + get_varint_size(view->uptime);
+}
+
+static size_t write_string(uint8_t tag, string_view_t view, uint8_t* out)
+{
+    size_t len = 0;
+    out[len++] = tag;
+    len += encode_varint(view.len, out + len);
+    memcpy(out + len, view.data, view.len);
+    return len + view.len;
+}
+
+size_t encode_report_view(const uptime_report_view_t* view, uint8_t* out)
+{
+    size_t len = 0;
+    len += write_string(tag_mac_address, view->mac_address, out + len);
+    len += write_string(tag_description, view->description, out + len);
+    out[len++] = tag_uptime;
+    len += encode_varint(view->uptime, out + len);
+    return len;
+}
+
+static char* copy_to_arena(string_view_t view, struct arena* arena)
+{
+    char* str = (char*)arena_alloc(arena, view.len + 1);
+    memcpy(str, view.data, view.len);
+    str[view.len] = '\0';
+    return str;
+}
+
+static uptime_report_t* unpack_report(const char* buffer, int len, struct arena* arena)
+{
+    ProtobufCAllocator allocator = { arena_protobuf_alloc, arena_protobuf_free, arena };
+    UptimeReportMsg* msg = uptime_report_msg__unpack(&allocator, len, (uint8_t*)buffer);
+    if (NULL == msg)
+        return NULL;
+
+    uptime_report_t* retval = (uptime_report_t*)arena_alloc(arena, sizeof(uptime_report_t));
+    retval->mac_address = msg->mac_address;
+    retval->description = msg->description;
     retval->uptime = msg->uptime;
+    return retval;
+}
+
+uptime_report_t* deserialize_report (const char* buffer, int len, struct arena* arena)
+{    
+    uptime_report_view_t view;
+    uptime_report_t* retval = NULL;
+
+    switch (decode_report_view((const uint8_t*)buffer, len, &view)) {
+        case REPORT_DECODE_OK:
+            retval = (uptime_report_t*)arena_alloc(arena, sizeof(uptime_report_t));
+            retval->mac_address = copy_to_arena(view.mac_address, arena);
+            retval->description = copy_to_arena(view.description, arena);
+            retval->uptime = view.uptime;
+            break;
+        case REPORT_DECODE_UNRECOGNIZED:
+            retval = unpack_report(buffer, len, arena);
+            break;
+        case REPORT_DECODE_MALFORMED:
+            break;
+    }
+
+    if (NULL == retval)
+        log_error("Failed to deserialize an incoming packet into an uptime report.");
 
-    uptime_report_msg__free_unpacked(msg, NULL);
     return retval;
 }
 
-uint8_t* serialize_report (uptime_report_t* unit)
+static uptime_report_view_t view_report(const uptime_report_t* unit)
 {
-    UptimeReportMsg msg = UPTIME_REPORT_MSG__INIT;
-    msg.mac_address = strdup(unit->mac_address);
-    msg.description = strdup(unit->description);
-    msg.uptime = unit->uptime;
+    uptime_report_view_t view = {
+        { unit->mac_address, strlen(unit->mac_address) },
+        { unit->description, strlen(unit->description) },
+        unit->uptime
+    };
+    return view;
+}
 
-    unsigned len = uptime_report_msg__get_packed_size(&msg);
-    uint8_t* buf = (uint8_t*)malloc(len);
-    uptime_report_msg__pack(&msg, buf);
+size_t get_serialized_report_size(const uptime_report_t* unit)
+{
+    uptime_report_view_t view = view_report(unit);
+    return get_report_view_size(&view);
+}
+
+size_t serialize_report_to_buffer(const uptime_report_t* unit, uint8_t* buf, size_t capacity)
+{
+    uptime_report_view_t view = view_report(unit);
+    if (get_report_view_size(&view) > capacity)
+        return 0;
+    return encode_report_view(&view, buf);
+}
+
+uint8_t* serialize_report (const uptime_report_t* unit, size_t* len)
+{
+    uptime_report_view_t view = view_report(unit);
+    size_t packed_len = get_report_view_size(&view);
+
+    uint8_t* buf = (uint8_t*)malloc(packed_len);
+    encode_report_view(&view, buf);
+
+    if (NULL != len)
+        *len = packed_len;
 
     return buf;
 }
 
+size_t encode_varint(uint64_t value, uint8_t* out)
+{
+    size_t len = 0;
+    while (value >= 0x80) {
+        out[len++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[len++] = (uint8_t)value;
+    return len;
+}
+
+int decode_varint(const uint8_t* buf, size_t len, uint64_t* value)
+{
+    uint64_t result = 0;
+
+    for (size_t i = 0; i < len && i < max_varint_len; i++) {
+        result |= (uint64_t)(buf[i] & 0x7f) << (7 * i);
+        if ((buf[i] & 0x80) == 0) {
+            *value = result;
+            return (int)(i + 1);
+        }
+    }
+
+    return (len >= max_varint_len) ? -1 : 0;
+}
+
 void free_uptime_report_t(uptime_report_t* report)
 {
     if (NULL == report)
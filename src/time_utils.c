@@ -12,7 +12,8 @@ time_t get_current_time()
 char* print_time_local(time_t rawtime)
 {
     char* retval = (char*)malloc(sizeof(char) * 20);
-    struct tm* timeinfo = localtime(&rawtime);
-    strftime(retval, 20, "%Y-%m-%d %H:%M:%S", timeinfo);
+    struct tm timeinfo;     // localtime's shared buffer isn't safe across ingest threads
+    localtime_r(&rawtime, &timeinfo);
+    strftime(retval, 20, "%Y-%m-%d %H:%M:%S", &timeinfo);
     return retval;
 }
\ No newline at end of file
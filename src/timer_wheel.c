@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "timer_wheel.h"
+
+static timer_wheel_node_t* slot_for(struct timer_wheel* wheel, time_t second)
+{
+    return &wheel->slots[(size_t)second & (wheel->slot_count - 1)];
+}
+
+static void unlink_node(timer_wheel_node_t* node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = NULL;
+    node->next = NULL;
+}
+
+struct timer_wheel* timer_wheel_init(size_t slot_count, time_t now)
+{
+    struct timer_wheel* wheel = (struct timer_wheel*)calloc(1, sizeof(struct timer_wheel));
+    wheel->slot_count = slot_count;
+    wheel->current = now;
+    wheel->slots = (timer_wheel_node_t*)calloc(slot_count, sizeof(timer_wheel_node_t));
+
+    // Each slot is the sentinel of a circular list.
+    for (size_t i = 0; i < slot_count; i++) {
+        wheel->slots[i].prev = &wheel->slots[i];
+        wheel->slots[i].next = &wheel->slots[i];
+    }
+
+    return wheel;
+}
+
+// Caller responsible for freeing nodes.
+void timer_wheel_free(struct timer_wheel* wheel)
+{
+    if (NULL == wheel)
+        return;
+
+    free(wheel->slots);
+    free(wheel);
+}
+
+void timer_wheel_node_init(timer_wheel_node_t* node, void* data)
+{
+    node->deadline = 0;
+    node->data = data;
+    node->prev = NULL;
+    node->next = NULL;
+}
+
+void timer_wheel_schedule(struct timer_wheel* wheel, timer_wheel_node_t* node, time_t deadline)
+{
+    if (NULL == wheel || NULL == node)
+        return;
+
+    if (node->next != NULL)
+        unlink_node(node);
+
+    // Anything already overdue goes in the next slot to be visited.
+    time_t second = (deadline > wheel->current) ? deadline : wheel->current + 1;
+    timer_wheel_node_t* slot = slot_for(wheel, second);
+
+    node->deadline = deadline;
+    node->prev = slot->prev;
+    node->next = slot;
+    slot->prev->next = node;
+    slot->prev = node;
+}
+
+void timer_wheel_cancel(timer_wheel_node_t* node)
+{
+    if (NULL != node && node->next != NULL)
+        unlink_node(node);
+}
+
+void timer_wheel_advance(struct timer_wheel* wheel, time_t now, void (*fptr)(timer_wheel_node_t*, void*), void* args)
+{
+    if (NULL == wheel || now <= wheel->current)
+        return;
+
+    // After a long stall every slot is visited exactly once.
+    time_t steps = now - wheel->current;
+    if (steps > (time_t)wheel->slot_count)
+        steps = (time_t)wheel->slot_count;
+
+    for (time_t i = 1; i <= steps; i++) {
+        timer_wheel_node_t* slot = slot_for(wheel, wheel->current + i);
+        timer_wheel_node_t* node = slot->next;
+
+        while (node != slot) {
+            timer_wheel_node_t* next = node->next;
+            if (node->deadline <= now) {
+                unlink_node(node);
+                (*fptr)(node, args);
+            }
+            node = next;
+        }
+    }
+
+    wheel->current = now;
+}
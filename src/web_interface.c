@@ -13,6 +13,12 @@
 *   the examples on the official github page: 
 *   https://github.com/warmcat/libwebsockets/blob/master/test-server/test-server.c
 *   The archived mailing list can also be helpful.
+*
+*   Every ws-event frame is binary and holds one or more
+*   uptime_report_msg, each preceded by its length as a
+*   base 128 varint.  A new client first gets a single
+*   frame with the state of every device, then a frame
+*   per broadcast made since that snapshot was taken.
 */
 
 #include <stdio.h>
@@ -20,8 +26,11 @@
 #include "libwebsockets.h"
 #include "uv.h"
 #include "serialization.h"
+#include "broadcast_log.h"
 #include "database.h"
 #include "logger.h"
+#include "ingest.h"
+#include "metrics.h"
 #include "web_interface.h"
 
 typedef struct resource {
@@ -30,19 +39,64 @@ typedef struct resource {
     char* mime_type;
 } resource;
 
+typedef struct ws_frame_t ws_frame_t;
+
+// A /metrics body still being sent.  It goes out a chunk per writeable
+// callback, and the transaction is completed once lws has sent it all.
+typedef struct per_session_data__http {
+    metrics_text metrics;
+    size_t metrics_sent;
+} per_session_data__http;
+
+#define metrics_chunk_len 4096
+
 typedef struct per_session_data__ws_event {
-    int ring_buffer_pos;
+    uint64_t cursor;                // Sequence number of the next broadcast to send
+    ws_frame_t* pending_snapshot;   // Sent before any broadcast, if set
 } per_session_data__ws_event;
 
-// This ringbuffer is used to keep track of data that should
-// be broadcast to all connected websocket clients.
-static uint8_t* ws_ring_buffer[10];
-static int ws_ringbuffer_current = 0;
+// An encoded websocket frame, serialized once and shared by every session
+// that sends it.  The broadcast log holds one reference until the frame is
+// overwritten and each session holds one while writing it, so the frame
+// is freed when the last of them lets go.
+struct ws_frame_t {
+    int refcount;
+    size_t len;
+    unsigned char* payload;     // Preceded by LWS_SEND_BUFFER_PRE_PADDING
+    unsigned char storage[];
+};
+
+// Reports are serialized straight into the frame's payload, which grows
+// as needed.
+typedef struct ws_frame_builder_t {
+    ws_frame_t* frame;
+    size_t capacity;
+} ws_frame_builder_t;
+
+// This log keeps track of data that should be broadcast to all connected
+// websocket clients; each session keeps its own cursor into it.  Reports
+// can be broadcast from thread pool threads, so the loop thread is woken
+// through broadcast_async to ask lws for writes.
+static broadcast_log* ws_broadcast_log = NULL;
+static uv_async_t broadcast_async;
+
+// The state of every device, pre-serialized into a single frame and shared
+// by every client that connects while it is current.  snapshot_version is
+// the head of the broadcast log when it was taken; new clients get the
+// deltas from there.  Only touched from the loop thread.
+static ws_frame_t* snapshot_frame = NULL;
+static uint64_t snapshot_version = 0;
+static uint64_t snapshot_generation = 0;
+
+// Set while the snapshot was built during the current loop turn, and
+// cleared by snapshot_check once the turn is over.
+static bool snapshot_built_this_turn = false;
+static uv_check_t snapshot_check;
 
 struct lws_context* context;
-static uv_timer_t* service_timer;
-static const int service_timer_interval_ms = 500;
+static int ws_client_count = 0;     // Only touched from the loop thread
 static char* directory_of_executing_assembly = NULL;
+static void (*terminate_handler)(int) = NULL;
 static bool running = false;
 static uv_rwlock_t running_lock;
 
@@ -81,13 +135,121 @@ static bool serve_file(struct lws* wsi, const char* uri)
     return true;
 }
 
+// Metrics recorded by the metrics module plus the ones other modules keep
+// for themselves.
+static void render_metrics(metrics_text* text)
+{
+    metrics_render(text);
+
+    int open_connections;
+    uint64_t rejected_connections, idle_connections;
+    get_connection_stats(&open_connections, &rejected_connections, &idle_connections);
+    metrics_append_value(text, "upkeep_open_connections", "gauge", "Open TCP connections.", open_connections);
+    metrics_append_value(text, "upkeep_idle_connections_closed_total", "counter", "TCP connections closed for being idle.", idle_connections);
+
+    uint64_t read_buffer_hits, read_buffer_misses;
+    get_read_buffer_stats(&read_buffer_hits, &read_buffer_misses);
+    metrics_append_value(text, "upkeep_read_buffer_hits_total", "counter", "Read buffers reused from the pool.", read_buffer_hits);
+    metrics_append_value(text, "upkeep_read_buffer_misses_total", "counter", "Read buffers freshly allocated.", read_buffer_misses);
+
+    uint64_t rate_limited_logs, repeated_logs;
+    get_suppressed_log_counts(&rate_limited_logs, &repeated_logs);
+    metrics_append_value(text, "upkeep_log_queue_depth", "gauge", "Log messages queued but not yet written.", get_log_queue_depth());
+    metrics_append_value(text, "upkeep_logs_dropped_total", "counter", "Log messages dropped with the log queue full.", get_dropped_log_count());
+    metrics_append_value(text, "upkeep_logs_rate_limited_total", "counter", "Log messages suppressed by the per call site rate limit.", rate_limited_logs);
+    metrics_append_value(text, "upkeep_logs_repeated_total", "counter", "Log messages collapsed as repeats of the one before.", repeated_logs);
+
+    metrics_append_value(text, "upkeep_ws_clients", "gauge", "Connected websocket clients.", ws_client_count);
+}
+
+static void free_pending_metrics(per_session_data__http* psd)
+{
+    metrics_text_free(&psd->metrics);
+    psd->metrics_sent = 0;
+}
+
+static int serve_metrics(struct lws* wsi, per_session_data__http* psd)
+{
+    static const char* content_type = "text/plain; version=0.0.4";
+
+    free_pending_metrics(psd);
+    render_metrics(&psd->metrics);
+
+    unsigned char headers[LWS_SEND_BUFFER_PRE_PADDING + 256];
+    unsigned char* start = headers + LWS_SEND_BUFFER_PRE_PADDING;
+    unsigned char* p = start;
+    unsigned char* end = headers + sizeof(headers);
+
+    if (lws_add_http_header_status(wsi, 200, &p, end) ||
+        lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CONTENT_TYPE, (const unsigned char*)content_type, strlen(content_type), &p, end) ||
+        lws_add_http_header_content_length(wsi, psd->metrics.len, &p, end) ||
+        lws_finalize_http_header(wsi, &p, end) ||
+        lws_write(wsi, start, p - start, LWS_WRITE_HTTP_HEADERS) < 0) {
+        free_pending_metrics(psd);
+        return 1;
+    }
+
+    // The body follows from LWS_CALLBACK_HTTP_WRITEABLE.
+    lws_callback_on_writable(wsi);
+    return 0;
+}
+
+// Writes chunks of the body until the socket pushes back.  Whatever part
+// of a chunk the socket didn't take is held by lws, which only calls back
+// again once it has been sent, so the transaction is completed on the
+// callback after the last chunk rather than straight after writing it.
+static int write_pending_metrics(struct lws* wsi, per_session_data__http* psd)
+{
+    if (NULL == psd->metrics.data)
+        return 0;
+
+    if (psd->metrics_sent == psd->metrics.len) {
+        free_pending_metrics(psd);
+        return lws_http_transaction_completed(wsi) ? -1 : 0;
+    }
+
+    unsigned char chunk[LWS_SEND_BUFFER_PRE_PADDING + metrics_chunk_len + LWS_SEND_BUFFER_POST_PADDING];
+    unsigned char* payload = chunk + LWS_SEND_BUFFER_PRE_PADDING;
+
+    do {
+        size_t len = psd->metrics.len - psd->metrics_sent;
+        if (len > metrics_chunk_len)
+            len = metrics_chunk_len;
+
+        memcpy(payload, psd->metrics.data + psd->metrics_sent, len);
+        if (lws_write(wsi, payload, len, LWS_WRITE_HTTP) < 0) {
+            free_pending_metrics(psd);
+            return -1;
+        }
+        psd->metrics_sent += len;
+    } while (psd->metrics_sent < psd->metrics.len && !lws_send_pipe_choked(wsi));
+
+    lws_callback_on_writable(wsi);
+    return 0;
+}
+
 static int callback_http (struct lws* wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len)
 {
+    per_session_data__http* psd = (per_session_data__http*)user;
+
+    if (reason == LWS_CALLBACK_HTTP_WRITEABLE)
+        return write_pending_metrics(wsi, psd);
+
+    if (reason == LWS_CALLBACK_CLOSED_HTTP) {
+        if (psd != NULL)
+            free_pending_metrics(psd);
+        return 0;
+    }
+
     if (reason != LWS_CALLBACK_HTTP)
         return 0;
 
     char* requested_uri = (char*)in;
 
+    // Scraped often enough that logging every request would drown the log.
+    if (strcmp(requested_uri, "/metrics") == 0)
+        return serve_metrics(wsi, psd);
+
     log_info("Client requested URI: %s", requested_uri);
 
     if (strcmp(requested_uri, "/") == 0) 
@@ -99,32 +261,174 @@ static int callback_http (struct lws* wsi, enum lws_callback_reasons reason, voi
     return 0;
 }
 
-static unsigned char* generate_lws_padded_msg(uint8_t* msg, int len)
+static ws_frame_t* alloc_ws_frame(size_t len)
+{
+    ws_frame_t* frame = (ws_frame_t*)malloc(sizeof(ws_frame_t) + 
+        LWS_SEND_BUFFER_PRE_PADDING + len + LWS_SEND_BUFFER_POST_PADDING);
+    frame->refcount = 1;
+    frame->len = len;
+    frame->payload = frame->storage + LWS_SEND_BUFFER_PRE_PADDING;
+    return frame;
+}
+
+static ws_frame_t* acquire_ws_frame(ws_frame_t* frame)
 {
-    unsigned char* buf = (unsigned char*)malloc(LWS_SEND_BUFFER_PRE_PADDING + 
-        len + LWS_SEND_BUFFER_POST_PADDING);
-    memcpy(buf + LWS_SEND_BUFFER_PRE_PADDING, msg, len);
-    return buf + LWS_SEND_BUFFER_PRE_PADDING;
+    __atomic_add_fetch(&frame->refcount, 1, __ATOMIC_RELAXED);
+    return frame;
 }
 
-static void free_lws_padded_msg(unsigned char* msg)
+static void release_ws_frame(void* data)
 {
-    if (msg != NULL) {
-        unsigned char* origin = msg - LWS_SEND_BUFFER_PRE_PADDING;
-        free(origin);
-        origin = NULL;
+    ws_frame_t* frame = (ws_frame_t*)data;
+    if (frame != NULL && __atomic_sub_fetch(&frame->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+        free(frame);
+}
+
+static void take_ws_frame(void* data, void* args)
+{
+    *(ws_frame_t**)args = acquire_ws_frame((ws_frame_t*)data);
+}
+
+static void start_frame(ws_frame_builder_t* builder, size_t capacity)
+{
+    builder->frame = alloc_ws_frame(capacity);
+    builder->frame->len = 0;
+    builder->capacity = capacity;
+}
+
+static void reserve_frame(ws_frame_builder_t* builder, size_t needed)
+{
+    ws_frame_t* frame = builder->frame;
+    if (frame->len + needed <= builder->capacity)
+        return;
+
+    builder->capacity = (frame->len + needed) * 2;
+    frame = (ws_frame_t*)realloc(frame, sizeof(ws_frame_t) + 
+        LWS_SEND_BUFFER_PRE_PADDING + builder->capacity + LWS_SEND_BUFFER_POST_PADDING);
+    frame->payload = frame->storage + LWS_SEND_BUFFER_PRE_PADDING;
+    builder->frame = frame;
+}
+
+static void append_report(ws_frame_builder_t* builder, uptime_report_t* report)
+{
+    size_t len = get_serialized_report_size(report);
+    reserve_frame(builder, get_varint_size(len) + len);
+
+    ws_frame_t* frame = builder->frame;
+    frame->len += encode_varint(len, frame->payload + frame->len);
+    frame->len += serialize_report_to_buffer(report, frame->payload + frame->len, len);
+}
+
+static ws_frame_t* build_report_frame(uptime_report_t* report)
+{
+    size_t len = get_serialized_report_size(report);
+
+    ws_frame_builder_t builder;
+    start_frame(&builder, get_varint_size(len) + len);
+    append_report(&builder, report);
+    return builder.frame;
+}
+
+static void append_device_state(const uint8_t* data, size_t len, void* args)
+{
+    ws_frame_builder_t* builder = (ws_frame_builder_t*)args;
+    reserve_frame(builder, len);
+    memcpy(builder->frame->payload + builder->frame->len, data, len);
+    builder->frame->len += len;
+}
+
+static bool snapshot_is_current()
+{
+    if (NULL == snapshot_frame)
+        return false;
+
+    // Too old to catch up from; clients would immediately be lagging.
+    if (broadcast_log_head(ws_broadcast_log) - snapshot_version >= ws_broadcast_log_capacity)
+        return false;
+
+    if (get_device_state_generation() == snapshot_generation)
+        return true;
+
+    // Devices have reported since, but every connection accepted in the
+    // same turn shares one rebuild, so a reconnect storm doesn't rebuild
+    // per connection.  Only reboots and outages are broadcast, so a
+    // snapshot must never outlive the turn it was built in.
+    return snapshot_built_this_turn;
+}
+
+static void on_snapshot_check(uv_check_t* handle)
+{
+    snapshot_built_this_turn = false;
+    uv_check_stop(handle);
+}
+
+static ws_frame_t* get_snapshot_frame(uint64_t* version)
+{
+    if (!snapshot_is_current()) {
+        // The last snapshot is the best guess at how big this one will be.
+        size_t capacity_hint = (snapshot_frame != NULL) ? snapshot_frame->len : 4096;
+        release_ws_frame(snapshot_frame);
+
+        // Taking the version first means a broadcast racing with the state
+        // read below is sent twice rather than not at all.
+        snapshot_version = broadcast_log_head(ws_broadcast_log);
+        snapshot_generation = get_device_state_generation();
+        snapshot_built_this_turn = true;
+        uv_check_start(&snapshot_check, on_snapshot_check);
+
+        // Devices keep their state serialized, so this is one copy each.
+        ws_frame_builder_t builder;
+        start_frame(&builder, capacity_hint);
+        device_state_foreach_serialized(append_device_state, &builder);
+        snapshot_frame = builder.frame;
     }
+
+    *version = snapshot_version;
+    return acquire_ws_frame(snapshot_frame);
 }
 
-static void send_record(uptime_entry_t* data, void* wsi)
+static int write_ws_frame(struct lws* wsi, ws_frame_t* frame)
 {
-    uint8_t* serialized = serialize_report(data);
-    int len = sizeof(serialized)/sizeof(uint8_t);
-    unsigned char* buf = generate_lws_padded_msg(serialized, len);
-    int result = lws_write((struct lws*)wsi, buf, len, LWS_WRITE_TEXT);
+    int written = lws_write(wsi, frame->payload, frame->len, LWS_WRITE_BINARY);
+    if (written >= 0)
+        metrics_count(METRIC_WS_FRAMES_SENT, 1);
+    return written;
+}
 
-    free_lws_padded_msg(buf);
-    free(serialized);
+static void send_full_state(struct lws* wsi, per_session_data__ws_event* psd)
+{
+    release_ws_frame(psd->pending_snapshot);
+    psd->pending_snapshot = get_snapshot_frame(&psd->cursor);
+    lws_callback_on_writable(wsi);
+}
+
+static int write_pending_snapshot(struct lws* wsi, per_session_data__ws_event* psd)
+{
+    int written = write_ws_frame(wsi, psd->pending_snapshot);
+    release_ws_frame(psd->pending_snapshot);
+    psd->pending_snapshot = NULL;
+
+    if (written < 0)
+        return -1;
+
+    if (psd->cursor < broadcast_log_head(ws_broadcast_log))
+        lws_callback_on_writable(wsi);
+    return 0;
+}
+
+static int handle_lagging_client(struct lws* wsi, per_session_data__ws_event* psd)
+{
+    uint64_t behind = broadcast_log_head(ws_broadcast_log) - psd->cursor;
+    metrics_count(METRIC_WS_LAGGING_CLIENTS, 1);
+
+    if (ws_lagging_client_policy == LAGGING_CLIENT_DISCONNECT) {
+        log_warn("Websocket client fell %llu broadcasts behind. Disconnecting it.", (unsigned long long)behind);
+        return -1;
+    }
+
+    log_warn("Websocket client fell %llu broadcasts behind. Resending full state.", (unsigned long long)behind);
+    send_full_state(wsi, psd);
+    return 0;
 }
 
 static int callback_ws_event (struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len)
@@ -133,15 +437,18 @@ static int callback_ws_event (struct lws *wsi, enum lws_callback_reasons reason,
 
     switch(reason) {
         case LWS_CALLBACK_ESTABLISHED: {
-            psd->ring_buffer_pos = ws_ringbuffer_current;
-
-            // Send all existing data in DB
-            uptime_record* to_send = get_uptime_record();
-            uptime_record_foreach(to_send, send_record, (void*)wsi);
-            free_uptime_record(to_send);
+            // Send all existing device state
+            psd->pending_snapshot = NULL;
+            ws_client_count++;
+            send_full_state(wsi, psd);
+            break;
         }
         case LWS_CALLBACK_CLOSED: {
+            release_ws_frame(psd->pending_snapshot);
+            psd->pending_snapshot = NULL;
+            ws_client_count--;
             log_info("Websocket connection closed by client.");
+            break;
         }
         case LWS_CALLBACK_RECEIVE: {
             // As this websocket interface is supposed to be one-way, all
@@ -149,10 +456,24 @@ static int callback_ws_event (struct lws *wsi, enum lws_callback_reasons reason,
             break;
         }
         case LWS_CALLBACK_SERVER_WRITEABLE: {
-            while(psd->ring_buffer_pos != ws_ringbuffer_current) {
-                unsigned char* to_write = (unsigned char*) ws_ring_buffer[psd->ring_buffer_pos];
-                lws_write(wsi, (sizeof(to_write) / sizeof(char*)), to_write, LWS_WRITE_TEXT);
-                psd->ring_buffer_pos = (psd->ring_buffer_pos) % 10;
+            // One write per writeable callback; ask for another if this
+            // session still has broadcasts to catch up on.
+            if (psd->pending_snapshot != NULL)
+                return write_pending_snapshot(wsi, psd);
+
+            ws_frame_t* frame = NULL;
+            broadcast_read_result read = broadcast_log_read(ws_broadcast_log, &psd->cursor, take_ws_frame, &frame);
+
+            if (read == BROADCAST_READ_LAGGING)
+                return handle_lagging_client(wsi, psd);
+
+            if (read == BROADCAST_READ_OK) {
+                int written = write_ws_frame(wsi, frame);
+                release_ws_frame(frame);
+                if (written < 0)
+                    return -1;
+                if (psd->cursor < broadcast_log_head(ws_broadcast_log))
+                    lws_callback_on_writable(wsi);
             }
             break;
         }
@@ -166,7 +487,7 @@ static struct lws_protocols protocols[] = {
     {
         "http-only",
         callback_http,
-        0,
+        sizeof(per_session_data__http),
     },
     {
         "ws-event",
@@ -190,18 +511,52 @@ static struct lws_context* build_context(const char* interface)
     info.ssl_private_key_filepath = NULL;   // ^^^
     info.gid = -1;
     info.uid = -1;
+#ifdef LWS_USE_LIBUV
+    info.options = LWS_SERVER_OPTION_LIBUV;
+#else
     info.options = 0;                       // No special options
+#endif
 
     return lws_create_context(&info);
 }
 
+#ifdef LWS_USE_LIBUV
+
+// lws takes over SIGINT and SIGTERM (among others) when it attaches to a
+// libuv loop, so those now arrive here, on the loop thread.
+static void on_lws_signal(uv_signal_t* watcher, int signum)
+{
+    log_info("Webserver received signal %d.", signum);
+
+    if (terminate_handler != NULL)
+        terminate_handler(signum);
+}
+
+// With LWS_SERVER_OPTION_LIBUV, lws registers its sockets with the loop
+// and is serviced whenever they are ready, so no polling is needed.
+static void attach_to_loop()
+{
+    lws_uv_initloop(context, uv_default_loop(), on_lws_signal, 0);
+}
+
+static void detach_from_loop()
+{
+}
+
+#else
+
+// Fallback for libwebsockets builds without libuv support (see
+// libs/Makefiles/libwebsockets/build.sh): poll lws from a loop timer.
+static uv_timer_t* service_timer;
+static const int service_timer_interval_ms = 500;
+
 static void on_lws_service_timer(uv_timer_t* handle)
 {
     // A call to lws_service(...) will respond to any queued lws requests and kick off the callback_http and callback_ws events.
     lws_service(context, 0);
 }
 
-static void start_lws_service_timer()
+static void attach_to_loop()
 {
     if (NULL == service_timer)
         service_timer = (uv_timer_t*)malloc(sizeof(uv_timer_t));
@@ -213,6 +568,20 @@ static void start_lws_service_timer()
     uv_timer_start(service_timer, on_lws_service_timer, service_timer_interval_ms, service_timer_interval_ms);
 }
 
+static void detach_from_loop()
+{
+    if (service_timer != NULL && uv_is_active((uv_handle_t*)service_timer))
+        uv_timer_stop(service_timer);
+}
+
+#endif
+
+static void on_broadcast_async(uv_async_t* handle)
+{
+    if (context)
+        lws_callback_on_writable_all_protocol(context, &protocols[PROTOCOL_WS_EVENT]);
+}
+
 static void populate_whitelist() 
 {
     for (int i = 0; i < (sizeof(whitelist)/sizeof(resource)); i++) {
@@ -233,17 +602,6 @@ static void cleanup_whitelist()
     }
 }
 
-static void cleanup_ringbuffer()
-{
-    for(int i=0; i<(sizeof(ws_ring_buffer)/sizeof(uint8_t*)); i++) {
-        if(ws_ring_buffer[i] != NULL) {
-            free_lws_padded_msg(ws_ring_buffer[i]);
-            ws_ring_buffer[i] = NULL;
-        }
-    }
-    ws_ringbuffer_current = 0;
-}
-
 static bool set_directory_of_executing_assembly()
 {
     directory_of_executing_assembly = getcwd(NULL, 0);
@@ -273,22 +631,22 @@ static bool server_already_running()
 
 void broadcast_report(uptime_report_t* data) 
 {
-    uint8_t* serialized = serialize_report(data);
-    int len = sizeof(serialized)/sizeof(uint8_t);
-    unsigned char* buf = generate_lws_padded_msg(serialized, len);
+    // Not started, or already shut down.
+    if (NULL == ws_broadcast_log)
+        return;
 
-    int ringbuffer_next = (ws_ringbuffer_current + 1) % 10;
+    uint64_t started_at = metrics_now();
 
-    if (ws_ring_buffer[ringbuffer_next] != NULL)
-        free_lws_padded_msg(ws_ring_buffer[ringbuffer_next]);
+    broadcast_log_append(ws_broadcast_log, build_report_frame(data));
 
-    ws_ring_buffer[ringbuffer_next] = buf;
-    ws_ringbuffer_current = ringbuffer_next;
+    // Safe from any thread; the write request itself is made on the loop thread.
+    uv_async_send(&broadcast_async);
 
-    lws_callback_on_writable_all_protocol(context, protocols);
+    metrics_count(METRIC_BROADCASTS, 1);
+    metrics_record_latency(STAGE_BROADCAST_REPORT, started_at);
 }
 
-void init_webserver()
+void init_webserver(void (*on_terminate_signal)(int))
 {
     if (server_already_running())
         return; 
@@ -305,21 +663,32 @@ void init_webserver()
 
     populate_whitelist();
 
-    start_lws_service_timer();
+    terminate_handler = on_terminate_signal;
+    ws_broadcast_log = broadcast_log_init(ws_broadcast_log_capacity, release_ws_frame);
+    uv_async_init(uv_default_loop(), &broadcast_async, on_broadcast_async);
+    uv_check_init(uv_default_loop(), &snapshot_check);
+    uv_unref((uv_handle_t*)&snapshot_check);
+
+    attach_to_loop();
 
     log_info("Web interface started.");
 }
 
 void shutdown_webserver()
 {
-    if (service_timer != NULL && uv_is_active((uv_handle_t*)service_timer))
-        uv_timer_stop(service_timer);
+    detach_from_loop();
 
     if(context)
         lws_context_destroy(context);
+    context = NULL;
 
     cleanup_whitelist();
-    cleanup_ringbuffer();
+    broadcast_log_free(ws_broadcast_log);
+    ws_broadcast_log = NULL;
+    uv_check_stop(&snapshot_check);
+    release_ws_frame(snapshot_frame);
+    snapshot_frame = NULL;
+    snapshot_built_this_turn = false;
 
     free(directory_of_executing_assembly);
     directory_of_executing_assembly = NULL;